@@ -2,12 +2,14 @@
 // Distributed under the terms of the GNU General Public License v2
 
 #include <avr/wdt.h>
+#include <avr/interrupt.h>
 #include <stdio.h>
 #include <avr/pgmspace.h>
 #include "Time.h"
 #include "Devices.h"
 #include "Utils.h"
 #include "EepromLog.h"
+#include "Scheduler.h"
 #include "main.h"
 
 // *** COMMON
@@ -25,6 +27,15 @@ bool CommonDevice::confirm_boot(SerialCommand *cmd)
 	return true;
 }
 
+// C5 is confirmed when the EEPROM is erased
+bool CommonDevice::confirm_clean(SerialCommand *cmd)
+{
+	if (cmd == NULL) return false;
+
+	cmd->set(CMD_COMMON, COMMON_LOG_CLEAN, 0, 0);
+	return send(cmd);
+}
+
 bool CommonDevice::run(SerialCommand *cmd)
 {
 	if ( cmd == NULL || cmd->get_type() != CMD_COMMON) return false;
@@ -48,8 +59,15 @@ bool CommonDevice::run(SerialCommand *cmd)
 		DDRC &= ~_BV(DDC2);  // NLOCK input
 		break;
 	case COMMON_LOG_CLEAN:  // C5
-		sys_log.clean();
-		if (!send(cmd)) return false;  // log was successfully cleaned
+		sys_log.clean();  // confirmed by confirm_clean()
+		break;
+	case COMMON_SCHEDULER:  // C6
+		if (!send_scheduler(cmd)) return false;
+		break;
+	case COMMON_BUDGET:  // C7:task:ticks
+		if (cmd->get_arg1() < 0 || cmd->get_arg1() >= TASK_NUM) return false;
+		if (cmd->get_arg2() < 0 || cmd->get_arg2() > uint16_t(-1)) return false;
+		if (!sys_scheduler.set_budget(cmd->get_arg1(), cmd->get_arg2())) return false;
 		break;
 	default:
 		return false;
@@ -84,12 +102,40 @@ bool CommonDevice::send_status(SerialCommand *cmd)
 	return send(cmd, (const unsigned char *)&status, sizeof status);
 }
 
+bool CommonDevice::send_scheduler(SerialCommand *cmd)
+{
+	SchedulerStatsPayload stats;
+	sys_scheduler.get_stats(&stats);
+
+	IF_DEBUG(printf_P(PSTR("Payload [Common:Scheduler] Rounds:%lu"), stats.rounds);
+		for (uint8_t i = 0; i < TASK_NUM; i++) printf_P(PSTR("; %u: %u %lu %u %u %lu"), i, stats.tasks[i].budget,
+			stats.tasks[i].runs, stats.tasks[i].cuts, stats.tasks[i].max_ticks, stats.tasks[i].ticks);
+		printf_P(PSTR("\r\n")));
+
+	return send(cmd, (const unsigned char *)&stats, sizeof stats);
+}
+
 // *** NRF
 
-NRFDevice::NRFDevice() : network(NULL)
+NRFDevice::NRFDevice() : network(NULL), irq_pending(true)
 {
 }
 
+// IRQ of the radio: PD2 (INT0), active low; the handler takes no SPI transaction
+void NRFDevice::setup(RF24Network *net)
+{
+	network = net;
+
+	DDRD &= ~_BV(DDD2);  // INPUT
+	PORTD |= _BV(PORTD2);  // pull-up, the pin is high without the radio module
+
+	cli();
+	EICRA = (EICRA & ~(_BV(ISC01) | _BV(ISC00))) | _BV(ISC01);  // the falling edge
+	EIFR = _BV(INTF0);  // the edges before the setup are covered by irq_pending
+	EIMSK |= _BV(INT0);
+	sei();
+}
+
 bool NRFDevice::run(SerialCommand *cmd)
 {
 	// comment out for the optimization
@@ -116,3 +162,8 @@ bool NRFDevice::run(SerialCommand *cmd)
 
 	return true;
 }
+
+ISR(INT0_vect)
+{
+	nrf_device._irq();
+}
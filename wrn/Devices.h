@@ -5,6 +5,7 @@
 #define DEVICES_H_
 
 #include <inttypes.h>
+#include <avr/io.h>
 #include <RF24Network.h>
 #include "HardwareSerial.h"
 #include "SerialCommand.h"
@@ -37,6 +38,8 @@ enum CommonCommand {
 	COMMON_RESET,
 	COMMON_PROGRAM,
 	COMMON_LOG_CLEAN,
+	COMMON_SCHEDULER,
+	COMMON_BUDGET,
 	COMMON_UNKNOWN
 };
 
@@ -55,9 +58,11 @@ protected:
 
 	bool time(int32_t);
 	bool send_status(SerialCommand *);
+	bool send_scheduler(SerialCommand *);
 public:
 	CommonDevice();
 	bool confirm_boot(SerialCommand *);
+	bool confirm_clean(SerialCommand *);
 	bool run(SerialCommand *);
 };
 
@@ -87,19 +92,28 @@ class NRFDevice : public Device
 private:
 	RF24Network *network;
 	RF24NetworkHeader header;
+	volatile bool irq_pending;  // the radio has pulled IRQ low since the last update
 public:
 	NRFDevice();
 	bool run(SerialCommand *);
-	void setup(RF24Network *net) { network = net; };
+	void setup(RF24Network *);
 	bool read(SerialCommand *);
+
+	// Interrupt handler
+	inline void _irq(void) { irq_pending = true; };
 };
 
+// The SPI traffic of the update is done only when the radio asks for it. IRQ stays low
+// while the radio has a flag set, so a packet which came during the update is not lost.
 inline bool NRFDevice::read(SerialCommand *cmd)
 {
 	// the device should work without the radio
 	if (network == NULL) return false; // || cmd == NULL
 
-	network->update();
+	if (irq_pending || bit_is_clear(PIND, PIND2)) {
+		irq_pending = false;
+		network->update();
+	}
 
 	if (network->available()) {
 		network->peek(header);
@@ -112,4 +126,6 @@ inline bool NRFDevice::read(SerialCommand *cmd)
 	return false;
 }
 
+extern NRFDevice nrf_device;
+
 #endif /* DEVICES_H_ */
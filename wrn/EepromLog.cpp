@@ -2,28 +2,61 @@
 // Distributed under the terms of the GNU General Public License v2
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
 #include <stdio.h>
 #include "Time.h"
 #include "EepromLog.h"
 #include "main.h"
 
-Log::Log() : size(0), log_begin(0), log_end(0), log_next(0), reverse(false)
+Log::Log() : size(0), log_begin(0), log_end(0), log_next(0), reverse(false), cleaning(false), clean_confirm(false), clean_next(0),
+	generation(0), queue_head(0), queue_tail(0), queue_byte(0)
 {
 	record.time = 0;
 	record.log_event = 0;
 }
 
+// The header is read and followed to the marker, the records are scanned only if it is
+// damaged. A log the scan cannot follow (e.g. of the layout without the header) is
+// erased; false - it is lost.
 bool Log::begin()
 {
 	size_t sr = sizeof record;
+	bool ok = true;
+
+	size = ((E2END + 1 - 2 * sizeof(LogHeader)) / sr) * sr;
+	reverse = false;
+
+	if (!read_header()) {
+		IF_DEBUG(printf_P(PSTR("Log [Header] Damaged\r\n")));
+		if (scan()) {
+			if (cleaning) log_begin = 0;  // the records past the marker are not erased yet
+			write_header();
+		} else {
+			IF_DEBUG(printf_P(PSTR("Log [Scan] Corrupted\r\n")));
+			erase();
+			ok = false;
+		}
+	}
+	if (cleaning) clean_next = log_end;  // the erase is resumed after a reset
+	log_next = log_begin;
+	IF_DEBUG(printf_P(PSTR("Log [Status] Size:%d, Length:%u; Begin:%d; End:%d; Next:%d; Generation:%u\r\n"),
+		size / sr - 1, length(), log_begin, log_end, log_next, generation));
+
+	return ok;
+}
+
+// the records up to the zero marker
+bool Log::scan()
+{
 	uint16_t end;
-	size = (E2END / sr) * sr;
 	log_begin = 0;
 	log_end = 0;
 	log_next = 0; // set to log_end after each iteration
-	reverse = false;
 
 	do {
 		end = log_next; // the next write will be to marker
@@ -35,17 +68,94 @@ bool Log::begin()
 	next();  // looking at the next record
 	log_end = end;
 	if (record.time == 0 && record.log_event == 0) log_begin = 0;
-	log_next = log_begin;
-	IF_DEBUG(printf_P(PSTR("Log [Status] Size:%d, Length:%u; Begin:%d; End:%d; Next:%d\r\n"),
-		size / sr - 1, length(), log_begin, log_end, log_next));
 
 	return true;
 }
 
+static uint8_t header_crc(const LogHeader *h)
+{
+	uint8_t crc = LOG_HEADER_SEED;
+
+	for (uint8_t i = 0; i < offsetof(LogHeader, crc); i++) crc = _crc8_ccitt_update(crc, ((const uint8_t *)h)[i]);
+	return crc;
+}
+
+// The newer valid copy; its end is a hint, the records written since it are followed.
+// The erase of clean() is resumed even if the log is scanned, the flag is still valid.
+bool Log::read_header()
+{
+	LogHeader h[2];
+	bool valid[2];
+	uint8_t i, records = size / sizeof record;
+
+	eeprom_read_block((void *)h, (const void *)(uintptr_t)size, sizeof h);
+	for (i = 0; i < 2; i++) {
+		valid[i] = h[i].crc == header_crc(&h[i]) && h[i].begin < records && h[i].end < records
+			&& (h[i].flags & ~LOG_HEADER_CLEANING) == 0;
+	}
+
+	if (valid[0] && valid[1]) i = (int8_t)(h[1].generation - h[0].generation) > 0;
+	else if (valid[0] || valid[1]) i = valid[1];
+	else return false;
+
+	generation = h[i].generation;
+	log_begin = h[i].begin * sizeof record;
+	log_end = h[i].end * sizeof record;
+	cleaning = h[i].flags & LOG_HEADER_CLEANING;
+
+	return follow();
+}
+
+// The records after the end of the header up to the marker, as write() has added them.
+// The header is written only when the end wraps, so there is less than one pass of them.
+bool Log::follow()
+{
+	size_t sr = sizeof record;
+	uint16_t n;
+
+	for (n = size / sr; n > 0; n--) {
+		log_next = log_end;
+		read_record();
+		if (record.time == 0 && record.log_event == 0) break;
+		if (record.time <= 0 || record.log_event == 0) return false;  // log is corrupted
+
+		log_end += sr;
+		if (log_end >= size) log_end = 0;
+		if (log_begin == log_end) {
+			log_begin += sr;
+			if (log_begin >= size) log_begin = 0;
+		}
+	}
+	if (n == 0) return false;  // no marker
+
+	// the reset came between the new marker and its record, the marker took the oldest slot
+	log_next = log_begin;
+	read_record();
+	if (log_begin != log_end && record.time == 0 && record.log_event == 0) {
+		log_begin += sr;
+		if (log_begin >= size) log_begin = 0;
+	}
+	return true;
+}
+
+// The copy of the next generation takes the place of the older one. It is written on
+// the repair, on the clean and its end and when the end wraps, not for every record.
+void Log::write_header()
+{
+	LogHeader h;
+
+	h.generation = ++generation;
+	h.begin = log_begin / sizeof record;
+	h.end = log_end / sizeof record;
+	h.flags = cleaning ? LOG_HEADER_CLEANING : 0;
+	h.crc = header_crc(&h);
+	enqueue(size + (generation & 1) * sizeof h, &h, sizeof h);
+}
+
 void Log::next()
 {
 	size_t sr = sizeof record;
-	eeprom_read_block((void *)&record, (const void *)log_next, sr);
+	read_record();
 	//IF_DEBUG(printf_P(PSTR("Log [Next] Pos:%d; Time:%ld; Event:%u\r\n"), log_next, record.time, record.log_event));
 	log_next += sr;
 	if (log_next >= size) log_next = 0;
@@ -56,10 +166,41 @@ void Log::prev()
 	size_t sr = sizeof record;
 	log_next -= sr;
 	if (log_next < 0) log_next = size - sr;
-	eeprom_read_block((void *)&record, (const void *)log_next, sr);
+	read_record();
 	//IF_DEBUG(printf_P(PSTR("Log [Prev] Pos:%d; Time:%ld; Event:%u\r\n"), log_next, record.time, record.log_event));
 }
 
+// The record at log_next; the queued writes are newer than the EEPROM
+void Log::read_record()
+{
+	uint8_t eerie = EECR & _BV(EERIE);
+
+	EECR &= ~_BV(EERIE);  // EEAR must not be changed by the interrupt while it is read
+	eeprom_read_block((void *)&record, (const void *)(uintptr_t)log_next, sizeof record);  // waits for a write in progress
+
+	// the pending entries, tail to head, the later one wins; the tail does not move while
+	// the interrupt is off, so an entry is either in the EEPROM or still here
+	for (uint8_t i = queue_tail; i != queue_head; i = (i + 1) % LOG_QUEUE_SIZE) {
+		if (queue[i].pos == log_next) memcpy(&record, queue[i].data, sizeof record);
+	}
+	EECR |= eerie;
+}
+
+// the only waiting is for a full queue, while two writes are in progress
+void Log::enqueue(int16_t pos, const void *data, uint8_t size)
+{
+	uint8_t i = (queue_head + 1) % LOG_QUEUE_SIZE;
+
+	while (i == queue_tail) {};  // the interrupt makes room
+
+	queue[queue_head].pos = pos;
+	queue[queue_head].size = size;
+	memcpy(queue[queue_head].data, data, size);
+	queue_head = i;
+
+	EECR |= _BV(EERIE);
+}
+
 LogRecord *Log::read()
 {
 	if (reverse) {
@@ -78,46 +219,73 @@ LogRecord *Log::read()
 	return &record;
 }
 
+// The new marker goes first: a reset before the record leaves the old marker in place,
+// so follow() stops at the old end and never runs into the oldest records.
 void Log::write(int32_t time, uint8_t log_event)
 {
 	size_t sr = sizeof record;
+	int16_t pos = log_end;
 
-	record.time = time;
-	record.log_event = log_event;
-
-	eeprom_write_block((const void *)&record, (void *)log_end, sr);
-	IF_DEBUG(printf_P(PSTR("Log [Write] Pos:%d; Time:%ld; Event:%u\r\n"), log_end, record.time, record.log_event));
 	log_end += sr;
 	if (log_end >= size) log_end = 0;
 
 	// marker
 	record.time = 0;
 	record.log_event = 0;
-	eeprom_write_block((const void *)&record, (void *)log_end, sr);
+	enqueue(log_end, &record, sr);
+
+	record.time = time;
+	record.log_event = log_event;
+	enqueue(pos, &record, sr);
+	IF_DEBUG(printf_P(PSTR("Log [Write] Pos:%d; Time:%ld; Event:%u\r\n"), pos, record.time, record.log_event));
+
 	if (log_begin == log_end) {
 		log_begin += sr;
 		if (log_begin >= size) log_begin = 0;
 		log_next = reverse ? log_end : log_begin;
 	}
+	if (log_end == 0) write_header();  // once per pass, follow() finds the rest
 }
 
-void Log::clean()
+// the log is empty at once, the EEPROM is erased by update() in the background
+void Log::erase()
 {
-	size_t sr = sizeof record;
-
 	log_begin = 0;
 	log_end = 0;
 	log_next = 0;
-	record.time = 0;
-	record.log_event = 0;
+	clean_next = 0;
+	cleaning = true;
+	write_header();  // with the flag, a reset does not stop the erase
+	IF_DEBUG(printf_P(PSTR("Log [Clean] Start\r\n")));
+}
 
-	do {
-		eeprom_write_block((const void *)&record, (void *)log_next, sr);
-		log_next += sr;
-		if (log_next >= size) log_next = 0;
-	} while (log_next != 0);
+void Log::clean()
+{
+	erase();
+	clean_confirm = true;
+}
+
+// One byte per call and only if the EEPROM is ready, so the main loop never waits for
+// a write (3.4 ms). The records written since clean() are kept. Returns true when the
+// erase requested by clean() is done, the one of begin() is not confirmed.
+bool Log::update()
+{
+	// the queued writes go first, the interrupt is off while the queue is empty
+	if (!cleaning || queue_head != queue_tail || !eeprom_is_ready()) return false;
 
-	IF_DEBUG(printf_P(PSTR("Log [Clean] Done\r\n")));  // 3.4 sec
+	if (clean_next < log_end) clean_next = log_end;
+	if (clean_next < size) {
+		eeprom_update_byte((uint8_t *)(uintptr_t)clean_next, 0);
+		clean_next++;
+		return false;
+	}
+
+	cleaning = false;
+	write_header();  // the flag is cleared when the last byte is erased
+	IF_DEBUG(printf_P(PSTR("Log [Clean] Done\r\n")));
+	if (!clean_confirm) return false;
+	clean_confirm = false;
+	return true;
 }
 
 uint16_t Log::length()
@@ -143,4 +311,17 @@ void Log::set_limit(uint16_t limit)
 	log_next = (size + log_next) % size;
 }
 
+// the cursor goes n records forward from the limit
+void Log::skip(uint16_t n)
+{
+	if (reverse || n == 0) return;
+
+	log_next = (log_next + n * sizeof record) % size;
+}
+
 Log sys_log;
+
+ISR(EE_READY_vect)
+{
+	sys_log._eeprom_ready_irq();
+}
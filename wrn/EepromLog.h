@@ -4,6 +4,15 @@
 #ifndef LOG_H_
 #define LOG_H_
 
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+// Must be <= 256 because uint8_t; the queue holds N-1 entries, a write is a record, a marker and a header
+#define LOG_QUEUE_SIZE 7
+#define LOG_HEADER_SEED 0x5A  // CRC-8, the erased and the zeroed EEPROM are not valid headers
+#define LOG_HEADER_CLEANING 0x01  // the old records past the end are being erased
+
 enum LogEvent {
 	LOG_EMPTY = 0,
 	LOG_BOOT,
@@ -16,6 +25,25 @@ struct LogRecord
 	uint8_t log_event;
 };
 
+// Two copies after the records, written in turn: one of them is intact whenever the
+// other one is being written. The newer valid copy and the records after its end up to
+// the marker are the log, the scan only repairs it.
+struct LogHeader
+{
+	uint8_t generation;
+	uint8_t begin;  // records
+	uint8_t end;
+	uint8_t flags;
+	uint8_t crc;
+};
+
+struct LogWrite
+{
+	int16_t pos;
+	uint8_t size;
+	uint8_t data[sizeof(LogRecord)];  // a record or a header
+};
+
 class Log {
 protected:
 	int16_t size;
@@ -23,10 +51,27 @@ protected:
 	int16_t log_end;
 	int16_t log_next;
 	bool reverse;
+	bool cleaning;
+	bool clean_confirm;  // the erase was requested by clean()
+	int16_t clean_next;  // the next byte to erase
+	uint8_t generation;  // of the last header
 	LogRecord record;
 
+	// the EE_READY interrupt writes one byte at a time, 3.4 ms each
+	LogWrite queue[LOG_QUEUE_SIZE];
+	volatile uint8_t queue_head;
+	volatile uint8_t queue_tail;
+	uint8_t queue_byte;  // of the entry at the tail
+
 	void next();
 	void prev();
+	void read_record();
+	void enqueue(int16_t, const void *, uint8_t);
+	bool scan();
+	bool read_header();
+	bool follow();
+	void write_header();
+	void erase();
 
 public:
 	Log();
@@ -34,11 +79,43 @@ public:
 	LogRecord *read();
 	void write(int32_t, uint8_t);
 	void clean();
+	bool update();
+	bool is_cleaning() { return cleaning; }
 	uint16_t length();
 	void set_reverse(bool);
 	void set_limit(uint16_t);
+	void skip(uint16_t);
+	uint16_t position() { return log_next / sizeof record; }  // the slot of the cursor
+
+	// Interrupt handler
+	inline void _eeprom_ready_irq(void);
 };
 
+inline void Log::_eeprom_ready_irq(void)
+{
+	// the foreground may enable the interrupt again after the queue is drained
+	if (queue_tail == queue_head) {
+		EECR &= ~_BV(EERIE);
+		return;
+	}
+
+	LogWrite &w = queue[queue_tail];
+	uint16_t pos = w.pos + queue_byte;
+	uint8_t data = w.data[queue_byte];
+
+	// a byte already in place is not programmed again, the interrupt comes back at once
+	if (eeprom_read_byte((const uint8_t *)(uintptr_t)pos) != data) {
+		EEAR = pos;
+		EEDR = data;
+		EECR |= _BV(EEMPE);
+		EECR |= _BV(EEPE);  // within 4 cycles after EEMPE
+	}
+
+	if (++queue_byte < w.size) return;
+	queue_byte = 0;
+	queue_tail = (queue_tail + 1) % LOG_QUEUE_SIZE;
+}
+
 extern Log sys_log;
 
 #endif /* LOG_H_ */
@@ -59,6 +59,7 @@ public:
 	void end(void);
 	void flush(void);
 	size_t available(void);
+	size_t available_for_write(void);
 	unsigned char read(void);
 	size_t write(unsigned char c);
 	size_t write(const char *str);
@@ -74,6 +75,11 @@ inline size_t HardwareSerial::available(void)
 	return (SERIAL_RX_BUFFER_SIZE + _rx_buffer_head - _rx_buffer_tail) % SERIAL_RX_BUFFER_SIZE;
 }
 
+inline size_t HardwareSerial::available_for_write(void)
+{
+	return (SERIAL_TX_BUFFER_SIZE + _tx_buffer_tail - _tx_buffer_head - 1) % SERIAL_TX_BUFFER_SIZE;
+}
+
 inline unsigned char HardwareSerial::read(void)
 {
 	if (_rx_buffer_head != _rx_buffer_tail) {
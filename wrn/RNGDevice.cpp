@@ -2,6 +2,7 @@
 // Distributed under the terms of the GNU General Public License v2
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,9 +13,32 @@
 
 
 RNGDevice::RNGDevice() : flood(false), byte(0), threshold(127), num_measures(0),
-	measure_limit(RNG_FAST_CALIBRATION), pan_left(0), pan_right(0), payload_len(0), fault(0), bit_flip(false)
+	measure_limit(RNG_FAST_CALIBRATION), pan_left(0), pan_right(0),
+	calibration_fine(false), calibration_base(0), calibration_below(0), fault(0), bit_flip(false), byte_bits(0),
+	payload_size(RNG_PAYLOAD_SIZE), send_buffer(0), queued(0), sending(false),
+	extractor(RNG_EXTRACTOR_LEGACY), raw_bits(0), emitted_bits(0), pair_pending(0), pair_bits(0),
+	sample_bits(0), raw(false), raw_index(0), raw_dropped(0),
+	conditioner(0), condition_bytes(0), arx_a(0), arx_b(0), condition_ticks(0), condition_outputs(0),
+	health(RNG_HEALTH_OK), health_pending(false), health_failures(0), rct_bit(false), rct_count(0),
+	apt_bit(false), apt_index(0), apt_count(0), sample_head(0), sample_tail(0), sample_overruns(0)
 {
 	memset(&payload, 0, sizeof payload);
+	memset(&payload_len, 0, sizeof payload_len);
+	memset(&histogram, 0, sizeof histogram);
+	memset(&calibration_bins, 0, sizeof calibration_bins);
+}
+
+// the samples are taken at a constant rate whatever the main loop does
+void RNGDevice::begin()
+{
+	// REFS: 01 - reference AVCC with external capacitor at AREF pin
+	// ADLAR: 0 - right adjust, the low-order bits are needed as well
+	// MUX: 0101 - input channel ADC5
+	ADMUX = _BV(REFS0) | _BV(MUX2) | _BV(MUX0);
+	ADCSRB = 0;  // ADTS: 000 - free running mode
+
+	// ADC Auto Trigger Enable; ADC Interrupt Enable; ADC Start Conversion
+	ADCSRA |= (_BV(ADATE) | _BV(ADIE) | _BV(ADSC));
 }
 
 bool RNGDevice::run(SerialCommand *cmd)
@@ -26,36 +50,63 @@ bool RNGDevice::run(SerialCommand *cmd)
 
 	if (type == CMD_RNG_SEND) {  // cmd from read()
 		switch ((RNGSendCommand)cmd->get_id()) {
-			case RNG_SEND_PAYLOAD: {
-				// in case it's forced
-				if (payload_len <= 0) return false;
+			case RNG_SEND_PAYLOAD:
+			case RNG_SEND_RAW: {
+				// in case it's forced or the mode has been changed
+				if (queued == 0 || sending || raw != (cmd->get_id() == RNG_SEND_RAW)) return false;
+				// the responses go first, the frame is asked for again by the next sample
+				if (!cmd->send_background(payload[send_buffer], frame_size())) break;
 #ifdef DEBUG
-				printf_P(PSTR("Payload [RNG]"));
-				for (uint16_t i = 0; i < payload_len; i++) printf_P(PSTR(" %02X"), payload[i]);
+				printf_P(raw ? PSTR("Payload [RNG:Raw]") : PSTR("Payload [RNG]"));
+				for (uint16_t i = 0; i < frame_size(); i++) printf_P(PSTR(" %02X"), payload[send_buffer][i]);
 				printf_P(PSTR("\r\n"));
 #endif
-				if (!send(cmd, (const unsigned char *)&payload, payload_len)) {
-					payload_len = 0;
-					return false;
-				}
-				payload_len = 0;
+				sending = true;
+				drain(cmd);
 				break;
 			}
+			case RNG_SEND_HEALTH:
+				discard();  // the bytes came from the failed source
+				return false;  // the error header is the report
 			default:
 				return false;
 		}
 	} else if (type == CMD_RNG) {
 		switch ((RNGCommand)cmd->get_id()) {
 		case RNG_FLOOD_ON:  // R0
+			reset_health();
 			flood = true;
 			break;
 		case RNG_FLOOD_OFF:  // R1
-			payload_len = 0;
+			discard();
 			flood = false;
 			break;  // calibration will be started on-the-fly
 		case RNG_STATUS:  // R2
 			if (!send_status(cmd)) return false;
 			break;
+		case RNG_EXTRACTOR:  // R3:n
+			if (cmd->get_arg1() < 0 || cmd->get_arg1() >= RNG_EXTRACTOR_UNKNOWN) return false;
+			set_extractor((RNGExtractor)cmd->get_arg1());
+			break;
+		case RNG_SAMPLE_BITS:  // R4:n
+			if (cmd->get_arg1() < 0 || cmd->get_arg1() > RNG_SAMPLE_BITS_MAX) return false;
+			set_sample_bits(cmd->get_arg1());
+			break;
+		case RNG_HISTOGRAM:  // R5
+			if (!send_histogram(cmd)) return false;
+			break;
+		case RNG_RAW:  // R6:n
+			if (cmd->get_arg1() < 0 || cmd->get_arg1() > 1) return false;
+			set_raw(cmd->get_arg1());
+			break;
+		case RNG_CONDITIONER:  // R7:n
+			if (cmd->get_arg1() == 1 || cmd->get_arg1() < 0 || cmd->get_arg1() > RNG_CONDITIONER_MAX) return false;
+			set_conditioner(cmd->get_arg1());
+			break;
+		case RNG_PAYLOAD:  // R8:n
+			if (cmd->get_arg1() < RNG_PAYLOAD_MIN || cmd->get_arg1() > RNG_PAYLOAD_MAX) return false;
+			set_payload_size(cmd->get_arg1());
+			break;
 		default:
 			return false;
 		}
@@ -64,6 +115,108 @@ bool RNGDevice::run(SerialCommand *cmd)
 	return true;
 }
 
+// the frame on the link is completed from its buffer, the other buffers (and a partial raw frame) are emptied
+void RNGDevice::discard()
+{
+	for (uint8_t i = 0; i < RNG_PAYLOAD_BUFFERS; i++) {
+		if (!sending || i != send_buffer) payload_len[i] = 0;
+	}
+	queued = sending ? 1 : 0;
+	raw_index = 0;
+	raw_dropped = 0;
+}
+
+void RNGDevice::start_calibration()
+{
+	measure_limit = RNG_FAST_CALIBRATION;
+	num_measures = 0;
+	calibration_fine = false;
+	calibration_below = 0;
+	memset(&calibration_bins, 0, sizeof calibration_bins);
+}
+
+// the counters show the yield of the extractor since it was set
+void RNGDevice::reset_counters()
+{
+	raw_bits = 0;
+	emitted_bits = 0;
+	byte_bits = 0;
+	pair_pending = 0;
+}
+
+void RNGDevice::set_extractor(RNGExtractor e)
+{
+	extractor = e;
+	reset_counters();
+}
+
+// 0 - one bit per sample from the calibrated comparator, otherwise the bits are
+// taken from the lowest ones, the host can choose them by the R5 histogram
+void RNGDevice::set_sample_bits(uint8_t n)
+{
+	sample_bits = n;
+	reset_counters();
+}
+
+// the frames of the other mode are sent or dropped, the new mode starts from empty buffers
+void RNGDevice::set_raw(bool on)
+{
+	discard();
+	raw = on;
+	byte_bits = 0;
+	pair_pending = 0;
+}
+
+// small frames for the latency, large ones for the throughput of the link
+void RNGDevice::set_payload_size(uint8_t size)
+{
+	discard();
+	payload_size = size;
+}
+
+// the flood is paused, only R0 starts it again
+void RNGDevice::fail_health(RNGHealth test)
+{
+	if (health & test) return;
+
+	if (health_failures < uint16_t(-1)) health_failures++;
+	health |= test;
+	if (flood) health_pending = true;
+	flood = false;
+}
+
+void RNGDevice::reset_health()
+{
+	health = RNG_HEALTH_OK;
+	health_pending = false;
+	rct_count = 0;
+	apt_index = 0;
+}
+
+// n raw bytes go into one output byte, so the output has up to n times the min-entropy per bit
+void RNGDevice::set_conditioner(uint8_t n)
+{
+	conditioner = n;
+	condition_bytes = 0;
+	condition_ticks = 0;
+	condition_outputs = 0;
+}
+
+// Iterated Peres: a node is von Neumann for its pairs, the XOR of every pair goes
+// to the left child and the bit of every equal pair to the right one, so most of the
+// entropy dropped by von Neumann is recovered. The tree is cut at RNG_PERES_DEPTH.
+void RNGDevice::peres(uint8_t node, bool bit)
+{
+	bool first;
+
+	if (node >= RNG_PERES_NODES) return;
+	if (!pair(node, bit, first)) return;
+
+	if (first != bit) emit(first);
+	peres(2 * node + 1, first ^ bit);
+	if (first == bit) peres(2 * node + 2, first);
+}
+
 bool RNGDevice::send_status(SerialCommand *cmd)
 {
 	RNGStatusPayload status;
@@ -72,9 +225,40 @@ bool RNGDevice::send_status(SerialCommand *cmd)
 	status.calibrated = !measure_limit;
 	status.flood = flood;
 	status.fault = fault;
+	status.extractor = extractor;
+	status.raw_bits = raw_bits;
+	status.emitted_bits = emitted_bits;
+	status.sample_bits = sample_bits;
+	status.conditioner = conditioner;
+	status.condition_cycles = condition_outputs ? condition_ticks * RNG_TIMER0_CYCLES / condition_outputs : 0;
+	status.health = health;
+	status.health_failures = health_failures;
+	status.payload_size = payload_size;
 
-	IF_DEBUG(printf_P(PSTR("Payload [RNG:Status] Threshold:%u; Calibrated:%u; Flood:%u; Fault:%u\r\n"),
-		status.threshold, status.calibrated, status.flood, status.fault));
+	IF_DEBUG(printf_P(PSTR("Payload [RNG:Status] Threshold:%u; Calibrated:%u; Flood:%u; Fault:%u; Overruns:%u; Extractor:%u; Raw:%lu; Emitted:%lu; Sample bits:%u; Conditioner:%u; Cycles:%u; Health:%u; Failures:%u; Payload:%u\r\n"),
+		status.threshold, status.calibrated, status.flood, status.fault, sample_overruns,
+		status.extractor, status.raw_bits, status.emitted_bits, status.sample_bits,
+		status.conditioner, status.condition_cycles, status.health, status.health_failures, status.payload_size));
 
 	return send(cmd, (const unsigned char *)&status, sizeof status);
 }
+
+// the bins stop at the maximum, the host sees the distribution whatever the rate is
+bool RNGDevice::send_histogram(SerialCommand *cmd)
+{
+	RNGHistogramPayload hist;
+
+	memcpy(&hist.counts, &histogram, sizeof hist.counts);
+	memset(&histogram, 0, sizeof histogram);
+
+	IF_DEBUG(printf_P(PSTR("Payload [RNG:Histogram]"));
+		for (uint8_t i = 0; i < RNG_HISTOGRAM_BINS; i++) printf_P(PSTR(" %u"), hist.counts[i]);
+		printf_P(PSTR("\r\n")));
+
+	return send(cmd, (const unsigned char *)&hist, sizeof hist);
+}
+
+ISR(ADC_vect)
+{
+	rng_device._adc_complete_irq();
+}
@@ -6,18 +6,61 @@
 
 #include "main.h"
 
-#define RNG_PAYLOAD_SIZE 64
-#define RNG_FAST_CALIBRATION 2048
+#define RNG_PAYLOAD_SIZE 64  // the default
+#define RNG_PAYLOAD_MIN 8  // low latency
+#define RNG_PAYLOAD_MAX 128  // SRAM: RNG_PAYLOAD_BUFFERS of it, the header is 4.5% of the frame
+// raw: the samples dropped since the previous frame (uint16_t), then 12 groups of 4 samples
+// in 5 bytes - bits 9..2 of every sample, then bits 1..0 of all 4 (the first at the lowest)
+#define RNG_RAW_GROUPS 12
+#define RNG_RAW_PAYLOAD_SIZE (2 + RNG_RAW_GROUPS * 5)
+#define RNG_PAYLOAD_BUFFERS 2  // one takes the bits while the other one is sent
+#define RNG_FAST_CALIBRATION 512  // measures per histogram pass, ~40ms each
+#define RNG_CALIBRATION_BINS 16  // the coarse pass takes the high nibble, the fine one the low nibble
+#define RNG_TRACKING_FAULT 3  // per 65536 measures, the threshold moves by one at most
+#define RNG_PERES_DEPTH 3  // levels of the iterated Peres extractor
+#define RNG_PERES_NODES ((1 << RNG_PERES_DEPTH) - 1)
+// ADC free running: 20MHz / 128 / 13 cycles = ~12k samples per second
+#define RNG_SAMPLE_BUFFER_SIZE 32  // power of 2
+#define RNG_HISTOGRAM_BINS 16  // the 4 lowest bits of the samples
+#define RNG_SAMPLE_BITS_MAX 4  // low-order bits of the 10 bit conversion, as many as R5 estimates
+#define RNG_CONDITIONER_MAX 8  // input bytes per output byte
+#define RNG_ARX_ROUNDS 4  // per input byte
+#define RNG_TIMER0_CYCLES 64  // Timer0 prescaler, see Time::Time()
+// SP 800-90B 4.4 for the assessed min-entropy of 0.5 per bit, false positives 2^-20
+#define RNG_RCT_CUTOFF 41  // the same bit in a row
+#define RNG_APT_WINDOW 1024  // bits
+#define RNG_APT_CUTOFF 793  // the first bit of the window in the window
 
 enum RNGCommand {
 	RNG_FLOOD_ON = 0,
 	RNG_FLOOD_OFF,
 	RNG_STATUS,
+	RNG_EXTRACTOR,  // R3:n, RNGExtractor
+	RNG_SAMPLE_BITS,  // R4:n, 0 - comparator, 1..RNG_SAMPLE_BITS_MAX - low-order bits
+	RNG_HISTOGRAM,  // R5, RNGHistogramPayload; the counters restart
+	RNG_RAW,  // R6:n, 1 - stream the ADC samples instead of the bits, 0 - stop
+	RNG_CONDITIONER,  // R7:n, 0 - off, 2..RNG_CONDITIONER_MAX - input bytes per output byte
+	RNG_PAYLOAD,  // R8:n, RNG_PAYLOAD_MIN..RNG_PAYLOAD_MAX bytes per frame
 	RNG_UNKNOWN
 };
 
+enum RNGExtractor {
+	RNG_EXTRACTOR_LEGACY = 0,  // XOR with an alternating bit
+	RNG_EXTRACTOR_VON_NEUMANN,
+	RNG_EXTRACTOR_PERES,
+	RNG_EXTRACTOR_UNKNOWN
+};
+
+enum RNGHealth {
+	RNG_HEALTH_OK = 0,
+	RNG_HEALTH_RCT = 1,  // repetition count test failed
+	RNG_HEALTH_APT = 2  // adaptive proportion test failed
+};
+
 enum RNGSendCommand {
 	RNG_SEND_PAYLOAD = 0,
+	RNG_SEND_RAW,
+	RNG_SEND_HEALTH,  // an error header, the flood is paused until R0
 	RNG_SEND_UNKNOWN
 };
 
@@ -27,6 +70,21 @@ struct RNGStatusPayload
 	uint8_t calibrated;
 	uint8_t flood;
 	uint16_t fault;
+	uint8_t extractor;
+	uint32_t raw_bits;  // from the comparator or the low-order bits
+	uint32_t emitted_bits;  // from the extractor
+	uint8_t sample_bits;
+	uint8_t conditioner;
+	uint16_t condition_cycles;  // per output byte, the average since the conditioner was set
+	uint8_t health;  // RNGHealth bits since R0
+	uint16_t health_failures;  // since the boot
+	uint8_t payload_size;
+};
+
+// the host estimates the entropy of the low-order bits of the samples
+struct RNGHistogramPayload
+{
+	uint16_t counts[RNG_HISTOGRAM_BINS];
 };
 
 class RNGDevice : public Device
@@ -39,106 +97,371 @@ protected:
 	uint16_t measure_limit;
 	uint16_t pan_left;
 	uint16_t pan_right;
-	uint8_t payload_len;
+	bool calibration_fine;
+	uint8_t calibration_base;  // the coarse bin of the median
+	uint16_t calibration_below;  // fine pass: the measures under the coarse bin
+	uint16_t calibration_bins[RNG_CALIBRATION_BINS];
+	uint8_t payload_len[RNG_PAYLOAD_BUFFERS];
 	uint16_t fault;
 	bool bit_flip;
-	uint8_t payload[RNG_PAYLOAD_SIZE];
+	uint8_t byte_bits;
+	uint8_t payload[RNG_PAYLOAD_BUFFERS][RNG_PAYLOAD_MAX];
+	uint8_t payload_size;
+	uint8_t send_buffer;  // the oldest full buffer
+	uint8_t queued;  // full buffers, the next one after them takes the bits
+	bool sending;  // the send_buffer is on the link
+
+	RNGExtractor extractor;
+	uint32_t raw_bits;
+	uint32_t emitted_bits;
+	// von Neumann: the first bit of a pair; Peres: one per node, the heap order
+	uint8_t pair_pending;  // bit mask of the nodes
+	uint8_t pair_bits;
+	uint8_t sample_bits;
+	uint16_t histogram[RNG_HISTOGRAM_BINS];
+	bool raw;
+	uint8_t raw_index;  // of the sample in the group
+	uint16_t raw_dropped;
+	uint8_t conditioner;
+	uint8_t condition_bytes;  // absorbed into the state since the last output
+	uint16_t arx_a;
+	uint16_t arx_b;
+	uint32_t condition_ticks;  // Timer0
+	uint16_t condition_outputs;
+	uint8_t health;
+	bool health_pending;  // the error header is not sent yet
+	uint16_t health_failures;
+	bool rct_bit;
+	uint8_t rct_count;
+	bool apt_bit;
+	uint16_t apt_index;
+	uint16_t apt_count;
+
+	volatile uint8_t sample_head;
+	volatile uint8_t sample_tail;
+	volatile uint16_t sample_overruns;
+	uint16_t samples[RNG_SAMPLE_BUFFER_SIZE];
 
 	bool send_status(SerialCommand *);
-	uint8_t read_measure();
+	bool send_histogram(SerialCommand *);
+	void set_extractor(RNGExtractor);
+	void set_sample_bits(uint8_t);
+	void set_raw(bool);
+	void set_payload_size(uint8_t);
+	void discard();
+	inline uint8_t frame_size();
+	inline void store_raw(uint16_t);
+	void set_conditioner(uint8_t);
+	inline bool condition();
+	inline void test_health(bool);
+	void fail_health(RNGHealth);
+	void reset_health();
+	void reset_counters();
+	void start_calibration();
+	inline bool calibrate(uint8_t);
+	inline void extract(bool);
+	inline void emit(bool);
+	inline bool request_send(SerialCommand *);
+	inline bool pair(uint8_t, bool, bool &);
+	void peres(uint8_t, bool);
 public:
 	RNGDevice();
+	void begin();
+	uint8_t available();
 	bool run(SerialCommand *);
 	bool read(SerialCommand *);
+	inline void drain(SerialCommand *);
+
+	// Interrupt handler
+	inline void _adc_complete_irq(void);
 };
 
-inline uint8_t RNGDevice::read_measure()
+inline uint8_t RNGDevice::available()
+{
+	return (sample_head - sample_tail) & (RNG_SAMPLE_BUFFER_SIZE - 1);
+}
+
+inline void RNGDevice::_adc_complete_irq(void)
+{
+	// ADCL is read first, then ADCH
+	uint16_t measure = ADC;
+	uint8_t i = (sample_head + 1) & (RNG_SAMPLE_BUFFER_SIZE - 1);
+
+	if (i != sample_tail) {
+		samples[sample_head] = measure;
+		sample_head = i;
+	} else sample_overruns++;
+}
+
+inline void RNGDevice::emit(bool bit)
+{
+	byte <<= 1;
+	if (bit) byte |= 0b00000001;
+	emitted_bits++;
+
+	if (++byte_bits < 8) return;
+	byte_bits = 0;
+	if (!flood) return;
+	if (conditioner && !condition()) return;
+	// the bytes are dropped only if the link is behind and all buffers are full
+	if (queued >= RNG_PAYLOAD_BUFFERS) return;
+
+	uint8_t i = (send_buffer + queued) % RNG_PAYLOAD_BUFFERS;
+	payload[i][payload_len[i]++] = byte;
+	if (payload_len[i] == payload_size) queued++;
+}
+
+// A sponge over a 32 bit ARX permutation (the Speck32 round without the key): every byte
+// is added to the state and mixed, one byte of the state goes out per conditioner bytes in.
+// Returns true when the byte is replaced by the output.
+inline bool RNGDevice::condition()
 {
-	uint8_t low, high;
+	uint8_t start = TCNT0;
 
-	// REFS: 01 - reference AVCC with external capacitor at AREF pin
-	// MUX: 0101 - input channel ADC5
-	ADMUX = _BV(REFS0) | _BV(MUX2) | _BV(MUX0);
+	arx_a ^= byte;
+	for (uint8_t i = RNG_ARX_ROUNDS; i > 0; i--) {
+		arx_a = ((arx_a >> 7) | (arx_a << 9)) + arx_b;
+		arx_a ^= i;  // no fixed point at zero
+		arx_b = ((arx_b << 2) | (arx_b >> 14)) ^ arx_a;
+	}
+	condition_ticks += uint8_t(TCNT0 - start);
+
+	if (++condition_bytes < conditioner) return false;
+	condition_bytes = 0;
+
+	byte = arx_a ^ arx_b;
+	if (condition_outputs == uint16_t(-1)) {  // start the average again
+		condition_ticks = 0;
+		condition_outputs = 0;
+	}
+	condition_outputs++;
+	return true;
+}
+
+inline uint8_t RNGDevice::frame_size()
+{
+	return raw ? RNG_RAW_PAYLOAD_SIZE : payload_size;
+}
+
+// a frame always starts with a new group, the samples are dropped only if all buffers are full
+inline void RNGDevice::store_raw(uint16_t sample)
+{
+	if (queued >= RNG_PAYLOAD_BUFFERS) {
+		if (raw_dropped < uint16_t(-1)) raw_dropped++;
+		return;
+	}
 
-	ADCSRA |= _BV(ADSC);  // ADC Start Conversion
-	while (bit_is_set(ADCSRA, ADSC));  // when the conversion is complete, it returns to zero
+	uint8_t i = (send_buffer + queued) % RNG_PAYLOAD_BUFFERS;
+	if (payload_len[i] == 0) {
+		memcpy(payload[i], &raw_dropped, sizeof raw_dropped);
+		payload_len[i] = sizeof raw_dropped;
+		raw_dropped = 0;
+	}
 
-	// ADC Data Register; ADCL must be read first, then ADCH
-	low = ADCL;
-	high = ADCH;
+	uint8_t *group = payload[i] + payload_len[i] - raw_index;
+	group[raw_index] = sample >> 2;
+	if (raw_index == 0) group[4] = sample & 0x03;
+	else group[4] |= (sample & 0x03) << (2 * raw_index);
+	payload_len[i]++;
+
+	if (++raw_index < 4) return;
+	raw_index = 0;
+	payload_len[i]++;  // the byte of the low-order bits
+	if (payload_len[i] == RNG_RAW_PAYLOAD_SIZE) queued++;
+}
+
+// the link takes the payload as it has room, the buffer is free when the frame is sent
+inline void RNGDevice::drain(SerialCommand *cmd)
+{
+	if (!sending) return;
+
+	cmd->transmit();
+	if (cmd->sending_background()) return;
+
+	payload_len[send_buffer] = 0;
+	send_buffer = (send_buffer + 1) % RNG_PAYLOAD_BUFFERS;
+	queued--;
+	sending = false;
+}
+
+// returns true when the pair of the node is complete, first is its first bit
+inline bool RNGDevice::pair(uint8_t node, bool bit, bool &first)
+{
+	uint8_t mask = 1 << node;
+
+	if (!(pair_pending & mask)) {
+		pair_pending |= mask;
+		if (bit) pair_bits |= mask;
+		else pair_bits &= ~mask;
+		return false;
+	}
 
-	// lower precision: 10 bit to 8 bit
-	return (high << 6) | (low >> 2);
+	pair_pending &= ~mask;
+	first = pair_bits & mask;
+	return true;
+}
+
+// Both tests are O(1) per bit: RCT catches a stuck source at once,
+// APT a large loss of entropy over a window of bits.
+inline void RNGDevice::test_health(bool bit)
+{
+	if (bit != rct_bit) {
+		rct_bit = bit;
+		rct_count = 1;
+	} else if (rct_count < RNG_RCT_CUTOFF && ++rct_count == RNG_RCT_CUTOFF) fail_health(RNG_HEALTH_RCT);
+
+	if (apt_index == 0) {
+		apt_bit = bit;
+		apt_count = 0;
+	}
+	if (bit == apt_bit && ++apt_count == RNG_APT_CUTOFF) fail_health(RNG_HEALTH_APT);
+	if (++apt_index == RNG_APT_WINDOW) apt_index = 0;
+}
+
+inline void RNGDevice::extract(bool bit)
+{
+	bool first;
+
+	raw_bits++;
+	test_health(bit);
+	switch (extractor) {
+	case RNG_EXTRACTOR_VON_NEUMANN:
+		// 01 -> 0; 10 -> 1; 00 and 11 are dropped
+		if (pair(0, bit, first) && first != bit) emit(first);
+		break;
+	case RNG_EXTRACTOR_PERES:
+		peres(0, bit);
+		break;
+	default:
+		// too many monobit failures, need bias removal
+		emit(bit ^ bit_flip);
+		bit_flip = !bit_flip;
+		break;
+	}
+}
+
+inline bool RNGDevice::request_send(SerialCommand *cmd)
+{
+	if (health_pending) {
+		health_pending = false;
+		cmd->set(CMD_RNG_SEND, RNG_SEND_HEALTH, health, 0);
+		return true;
+	}
+
+	if (queued == 0 || sending) return false;
+
+	// the header is sent by the run() when the link is free, the payload is drained later
+	cmd->set(CMD_RNG_SEND, raw ? RNG_SEND_RAW : RNG_SEND_PAYLOAD, 0, 0);
+	return true;
+}
+
+// The median of one window is found in two passes of 16 bins: the coarse one picks
+// the bin of the high nibble, the fine one the low nibble inside it.
+// Returns true when the threshold is set.
+inline bool RNGDevice::calibrate(uint8_t measure)
+{
+	uint16_t rank;
+	uint8_t i;
+
+	if (!calibration_fine) calibration_bins[measure >> 4]++;
+	else if (measure < calibration_base) calibration_below++;
+	else if (measure - calibration_base < RNG_CALIBRATION_BINS) calibration_bins[measure - calibration_base]++;
+
+	if (++num_measures < measure_limit) return false;
+
+	rank = calibration_below;
+	for (i = 0; i < RNG_CALIBRATION_BINS - 1; i++) {
+		rank += calibration_bins[i];
+		if (rank >= measure_limit / 2) break;
+	}
+
+	num_measures = 0;
+	calibration_below = 0;
+	memset(&calibration_bins, 0, sizeof calibration_bins);
+
+	if (!calibration_fine) {
+		calibration_base = i << 4;
+		calibration_fine = true;
+		return false;
+	}
+
+	threshold = calibration_base + i;
+	calibration_fine = false;
+	IF_DEBUG(printf_P(PSTR("[Calibration] Threshold:%u\r\n"), threshold));
+	return true;
 }
 
 // This functions is little bit confusing, but I believe it is the best possible solution.
 // The other options demands large buffer or strong calculations to balance the threshold.
 inline bool RNGDevice::read(SerialCommand *cmd)
 {
+	uint16_t sample;
 	uint8_t measure;
-	bool balance;
-	uint16_t acceptable_fault;
 
 	// comment out for the optimization
 	//if (cmd == NULL) return false;
 
-	measure = read_measure();
-	// count starts from 1 and goes up to overflow (natural or artificial)
-	num_measures++;
+	if (sample_head == sample_tail) return false;
+	sample = samples[sample_tail];
+	sample_tail = (sample_tail + 1) & (RNG_SAMPLE_BUFFER_SIZE - 1);
+
+	uint16_t &bin = histogram[sample & (RNG_HISTOGRAM_BINS - 1)];
+	if (bin < uint16_t(-1)) bin++;
+
+	if (raw) {
+		if (!flood) return false;
+		store_raw(sample);
+		return request_send(cmd);
+	}
+
+	// the noise is in the lowest bits, no threshold is needed
+	if (sample_bits) {
+		for (uint8_t i = sample_bits; i > 0; i--) extract(sample & (1 << (i - 1)));
+		return request_send(cmd);
+	}
+
+	measure = sample >> 2;  // the comparator needs the 8 most significant bits
+
+	if (measure_limit) {
+		if (!calibrate(measure)) return false;
+		// the median is found, the small steps of the tracking follow the drift
+		measure_limit = 0;
+		pan_left = 0;
+		pan_right = 0;
+		byte_bits = 0;
+		pair_pending = 0;
+		return false;  // pass this cycle to start new byte from the first bit
+	}
 
-	if (num_measures == measure_limit) {
-		balance = false;
+	// count starts from 1 and goes up to the natural overflow
+	if (++num_measures == 0) {
 		if (pan_left > pan_right) fault = pan_left - pan_right;
 		else fault = pan_right - pan_left;
-		acceptable_fault = ((measure_limit - 1) / 256 + 1) * 3;
 
-		if (fault > acceptable_fault) {
+		if (fault > RNG_TRACKING_FAULT) {
 			if (pan_right > pan_left && threshold < uint8_t(-1)) threshold++;
 			else if (pan_left >= pan_right && threshold > 0) threshold--;
-		} else balance = true;
+		}
 
-		IF_DEBUG(printf_P(PSTR("[Calibration] Measures:%u; Threshold:%u; Limit: %u; Max: %u; [%u:%u=%u]; Balance:%s\r\n"),
-		num_measures - 1, threshold, measure_limit - 1, acceptable_fault, pan_left, pan_right, fault, balance ? "YES" : "NO"));
+		IF_DEBUG(printf_P(PSTR("[Tracking] Threshold:%u; [%u:%u=%u]\r\n"), threshold, pan_left, pan_right, fault));
 
-		if (measure_limit) num_measures = 0;
 		pan_left = 0;
 		pan_right = 0;
 
-		// switch to calibration mode in case the problem is found
-		if (threshold == 0 || fault == uint16_t(-1)) {
-			measure_limit = RNG_FAST_CALIBRATION;
-			balance = false;
-		}
-
-		if (balance && measure_limit) {  // balance just found
-			measure_limit = 0;
-			return false;  // pass this cycle to start new byte from the first bit
-		}
-	} else {  // drop one measure per calibration cycle to prevent possible overflow
-		if (measure <= threshold) pan_left++;
-		else pan_right++;
+		// the source has changed too much, find the median again
+		if (threshold == 0 || fault == uint16_t(-1)) start_calibration();
+		return false;
 	}
 
-	if (measure_limit) return false;
+	// drop one measure per tracking cycle to prevent possible overflow
+	if (measure <= threshold) pan_left++;
+	else pan_right++;
 
-	byte <<= 1;
-	if (measure > threshold) byte |= 0b00000001;
-	// too many monobit failures, need bias removal
-	byte ^= bit_flip;
-	bit_flip = !bit_flip;
-
-	// num_measures is power of 2, so overflow is not a problem
-	if (flood && num_measures % 8 == 0) {
-		if (payload_len < sizeof payload) {
-			payload[payload_len++] = byte;
-		} else {
-			// payload_len will be reseted in the run()
-			cmd->set(CMD_RNG_SEND, RNG_SEND_PAYLOAD, 0, 0);
-			return true;
-		}
-	}
+	extract(measure > threshold);
 
-	return false;
+	return request_send(cmd);
 }
 
+extern RNGDevice rng_device;
+
 #endif /* RNGDEVICE_H_ */
@@ -0,0 +1,88 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "HardwareSerial.h"
+#include "Scheduler.h"
+#include "main.h"
+
+Scheduler::Scheduler() : tasks(NULL), rounds(0)
+{
+}
+
+// Timer1 is free running, a task is measured by the difference of TCNT1
+void Scheduler::begin(Task *t)
+{
+	tasks = t;
+
+	TCCR1A = 0;  // WGM: normal mode
+	TCCR1B = _BV(CS11) | _BV(CS10);  // CLKio/64 prescaler
+}
+
+// the commands are waiting to be parsed or the responses to be sent
+bool Scheduler::serial_busy()
+{
+	return sys_serial.available() > 0 || sys_serial.available_for_write() < SCHED_TX_LOW;
+}
+
+// NB: a task which blocks longer than the period of Timer1 (210ms) is counted modulo it
+void Scheduler::run()
+{
+	Task *t;
+	uint16_t start, elapsed, budget;
+	bool more;
+
+	for (uint8_t i = 0; i < TASK_NUM; i++) {
+		t = &tasks[i];
+		budget = t->budget;
+		if (t->yields && serial_busy()) {
+			budget >>= SCHED_BACKOFF;
+			if (t->cuts < uint16_t(-1)) t->cuts++;
+		}
+
+		PROFILE(PROFILE_NRF + i);
+		start = TCNT1;
+		do {
+			more = t->run();
+			t->runs++;
+			elapsed = TCNT1 - start;
+		} while (more && elapsed < budget);
+
+		t->ticks += elapsed;
+		if (elapsed > t->max_ticks) t->max_ticks = elapsed;
+	}
+	rounds++;
+}
+
+bool Scheduler::set_budget(uint8_t task, uint16_t budget)
+{
+	if (task >= TASK_NUM) return false;
+
+	tasks[task].budget = budget;
+	IF_DEBUG(printf_P(PSTR("Scheduler [Budget] Task:%u; Ticks:%u\r\n"), task, budget));
+	return true;
+}
+
+// the counters start again after the report, so it shows the rates of the last period
+void Scheduler::get_stats(SchedulerStatsPayload *stats)
+{
+	stats->rounds = rounds;
+	rounds = 0;
+
+	for (uint8_t i = 0; i < TASK_NUM; i++) {
+		stats->tasks[i].budget = tasks[i].budget;
+		stats->tasks[i].runs = tasks[i].runs;
+		stats->tasks[i].cuts = tasks[i].cuts;
+		stats->tasks[i].max_ticks = tasks[i].max_ticks;
+		stats->tasks[i].ticks = tasks[i].ticks;
+		tasks[i].runs = 0;
+		tasks[i].cuts = 0;
+		tasks[i].max_ticks = 0;
+		tasks[i].ticks = 0;
+	}
+}
+
+Scheduler sys_scheduler;
@@ -0,0 +1,72 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <inttypes.h>
+#include <avr/io.h>
+
+#define SCHED_TIMER1_CYCLES 64  // Timer1 prescaler, the budgets are in its ticks
+#define SCHED_RNG_BUDGET 312  // ~1ms @ 20MHz, ~12 samples come in the time
+#define SCHED_TX_LOW 16  // free bytes of the TX buffer, the serial is busy below it
+#define SCHED_BACKOFF 2  // the budget of a yielding task is 1/2^n while the serial is busy
+
+// the order of the tasks in a round
+enum SchedulerTask {
+	TASK_NRF = 0,
+	TASK_RNG,
+	TASK_WDT,
+	TASK_CMD,
+	TASK_NUM
+};
+
+typedef bool (*TaskFunction)(void);  // true - the task has more work
+
+// A task is run once per round and then again while it has more work and its
+// budget is not spent; 0 - one run per round.
+struct Task
+{
+	TaskFunction run;
+	uint16_t budget;
+	bool yields;  // the budget is cut while the serial is busy
+	// the statistics since the last report
+	uint32_t runs;
+	uint16_t cuts;  // rounds with the cut budget
+	uint16_t max_ticks;  // of a round
+	uint32_t ticks;
+};
+
+struct SchedulerTaskStats
+{
+	uint16_t budget;
+	uint32_t runs;
+	uint16_t cuts;
+	uint16_t max_ticks;
+	uint32_t ticks;
+};
+
+struct SchedulerStatsPayload
+{
+	uint32_t rounds;
+	SchedulerTaskStats tasks[TASK_NUM];
+};
+
+class Scheduler
+{
+protected:
+	Task *tasks;
+	uint32_t rounds;
+
+	bool serial_busy();
+public:
+	Scheduler();
+	void begin(Task *);
+	void run();  // one round
+	bool set_budget(uint8_t, uint16_t);
+	void get_stats(SchedulerStatsPayload *);
+};
+
+extern Scheduler sys_scheduler;
+
+#endif /* SCHEDULER_H_ */
@@ -12,7 +12,8 @@
 uint16_t SerialCommand::seq_num = 0;
 
 SerialCommand::SerialCommand(HardwareSerial *serial) : serial(serial),
-	cmd_status(CS_TYPE), cmd_type(CMD_UNKNOWN), cmd_id(0), cmd_arg1(0), cmd_arg2(0)
+	cmd_status(CS_TYPE), cmd_type(CMD_UNKNOWN), cmd_id(0), cmd_arg1(0), cmd_arg2(0),
+	queue_head(0), queue_tail(0), frame_left(0), frame_payload(NULL)
 {
 }
 
@@ -92,57 +93,150 @@ void SerialCommand::print_cmd()
 	IF_DEBUG(printf_P(PSTR("%d[%d]:%ld:%ld\r\n"), (int)cmd_type, cmd_id, cmd_arg1, cmd_arg2));
 }
 
+// the frame is queued, it gets the seq_num when it goes to the link
 bool SerialCommand::send_header(int16_t payload_size)
 {
 	if (serial == NULL) return false;
 
-	payload_header.type_id = (uint8_t)cmd_type;
-	payload_header.cmd_id = (uint8_t)cmd_id;
-	payload_header.seq_num = seq_num;
-	payload_header.payload_size = payload_size;
-	seq_num++;
+	QueuedHeader header;
+	header.type_id = (uint8_t)cmd_type;
+	header.cmd_id = (uint8_t)cmd_id;
+	header.payload_size = payload_size;
 
 #ifdef DEBUG
-	printf_P(PSTR("Header #%d [%d:%d]:%d\r\n"),
-		payload_header.seq_num, payload_header.type_id, payload_header.cmd_id, payload_header.payload_size);
-	return true;
+	printf_P(PSTR("Header [%d:%d]:%d\r\n"), header.type_id, header.cmd_id, header.payload_size);
 #else
-	size_t n = serial->write((const unsigned char *)&payload_header, sizeof payload_header);
-	if (n == (sizeof payload_header)) return true;
+	enqueue((const unsigned char *)&header, sizeof header);
+	transmit();
 #endif
 
-	return false;
+	return true;
 }
 
 bool SerialCommand::send_payload(const unsigned char *payload, size_t size)
 {
 	if (serial == NULL || payload == NULL) return false;
 
+#ifndef DEBUG
+	enqueue(payload, size);
+	transmit();
+#endif
+
+	return true;
+}
+
+// The frame starts only on the idle link and with the room for its header in the TX buffer,
+// transmit() takes the payload as the TX buffer has room for it.
+bool SerialCommand::send_background(const unsigned char *payload, int16_t size)
+{
+	if (serial == NULL || payload == NULL) return false;
+
 #ifdef DEBUG
+	printf_P(PSTR("Header #%d [%d:%d]:%d\r\n"), seq_num++, (int)cmd_type, cmd_id, size);
 	return true;
 #else
-	size_t n = serial->write(payload, size);
-	if (n == size) return true;
-#endif
+	if (!queue_empty() || frame_left > 0 || serial->available_for_write() < sizeof payload_header) return false;
 
-	return false;
+	payload_header.type_id = (uint8_t)cmd_type;
+	payload_header.cmd_id = (uint8_t)cmd_id;
+	payload_header.seq_num = seq_num++;
+	payload_header.payload_size = size;
+	serial->write((const unsigned char *)&payload_header, sizeof payload_header);
+
+	frame_left = size;
+	frame_payload = payload;
+	transmit();
+	return true;
+#endif
 }
 
 bool SerialCommand::send_sync()
 {
 	if (serial == NULL || cmd_arg1 <= 0 || cmd_arg1 > MAX_SYNC_SEQUENCE) return false;
 
-	unsigned char sync_buffer[cmd_arg1];
-	memset(&sync_buffer, 0xFF, cmd_arg1);
-	seq_num = 0;
-
 #ifdef DEBUG
+	seq_num = 0;
 	printf_P(PSTR("Sync sequence: %ld sent\r\n"), cmd_arg1);
-	return true;
 #else
-	size_t n = serial->write((const unsigned char *)&sync_buffer, cmd_arg1);
-	if (n == cmd_arg1) return true;
+	QueuedHeader header;
+	header.type_id = TX_SYNC;
+	header.cmd_id = 0;
+	header.payload_size = cmd_arg1;
+
+	enqueue((const unsigned char *)&header, sizeof header);
+	transmit();
 #endif
 
-	return false;
+	return true;
+}
+
+// the queue is full only if the link is far behind, the TX interrupt makes room
+void SerialCommand::enqueue(const unsigned char *data, size_t size)
+{
+	uint8_t i;
+
+	while (size--) {
+		i = (queue_head + 1) % TX_QUEUE_SIZE;
+		while (i == queue_tail) transmit();
+		queue[queue_head] = *data++;
+		queue_head = i;
+	}
+}
+
+void SerialCommand::peek(unsigned char *data, size_t size)
+{
+	for (uint8_t i = queue_tail; size > 0; size--, i = (i + 1) % TX_QUEUE_SIZE) *data++ = queue[i];
+}
+
+// The frames go to the TX buffer as much as it takes without waiting. A frame on the
+// link is completed first, then the queued ones go before the next background frame.
+void SerialCommand::transmit()
+{
+	QueuedHeader header;
+	uint8_t n;
+
+	while (true) {
+		size_t room = serial->available_for_write();
+
+		if (frame_left == 0) {
+			// the header may be being queued
+			if (queued() < sizeof header) return;
+			peek((unsigned char *)&header, sizeof header);
+
+			if (header.type_id == TX_SYNC) {
+				if (room < (size_t)header.payload_size) return;
+				for (uint8_t i = header.payload_size; i > 0; i--) serial->write(0xFF);
+				seq_num = 0;
+			} else {
+				if (room < sizeof payload_header) return;
+				payload_header.type_id = header.type_id;
+				payload_header.cmd_id = header.cmd_id;
+				payload_header.seq_num = seq_num++;
+				payload_header.payload_size = header.payload_size;
+				serial->write((const unsigned char *)&payload_header, sizeof payload_header);
+				if (header.payload_size > 0) frame_left = header.payload_size;
+				frame_payload = NULL;
+			}
+			queue_tail = (queue_tail + sizeof header) % TX_QUEUE_SIZE;
+			continue;
+		}
+
+		if (frame_payload != NULL) {
+			// the background stays only a little ahead of the wire, a response waits less behind it
+			size_t used = SERIAL_TX_BUFFER_SIZE - 1 - room;
+			n = used < TX_BACKGROUND_AHEAD ? TX_BACKGROUND_AHEAD - used : 0;
+			if (n > frame_left) n = frame_left;
+			if (n == 0) return;
+			serial->write(frame_payload, n);
+			frame_payload += n;
+		} else {
+			n = (size_t)frame_left < room ? frame_left : room;
+			if (n > queued()) n = queued();  // the payload may be being queued
+			if (n > TX_QUEUE_SIZE - queue_tail) n = TX_QUEUE_SIZE - queue_tail;
+			if (n == 0) return;
+			serial->write(queue + queue_tail, n);
+			queue_tail = (queue_tail + n) % TX_QUEUE_SIZE;
+		}
+		frame_left -= n;
+	}
 }
@@ -9,6 +9,11 @@
 
 #define MAX_SYNC_SEQUENCE 8
 #define CMD_SIZE_SOFT_LIMIT 16
+// Must be <= 256 because uint8_t; the responses wait here for the link, the largest
+// one is a page of the WDT log. The foreground waits only if the queue is full.
+#define TX_QUEUE_SIZE 128
+#define TX_BACKGROUND_AHEAD 32  // bytes of the TX buffer for the background frame, ~5ms @ 57600
+#define TX_SYNC 0xFF  // the type of the queued sync sequence, the seq_num starts again after it
 
 #include "HardwareSerial.h"
 
@@ -19,6 +24,13 @@ struct PayloadHeader {
 	int16_t payload_size;
 };
 
+// the header in the queue, the seq_num is given when the frame goes to the link
+struct QueuedHeader {
+	uint8_t type_id;
+	uint8_t cmd_id;
+	int16_t payload_size;
+};
+
 enum SerialCommandStatus {
 	CS_TYPE,
 	CS_ID,
@@ -49,6 +61,18 @@ protected:
 	int32_t cmd_arg2;
 	PayloadHeader payload_header;
 
+	// Two sources share the link, a frame is the unit: the queued frames of the foreground
+	// go first, the background (RNG) starts a frame only when the queue is empty.
+	uint8_t queue[TX_QUEUE_SIZE];
+	uint8_t queue_head;
+	uint8_t queue_tail;
+	int16_t frame_left;  // payload bytes of the frame on the link
+	const unsigned char *frame_payload;  // of the background frame, its source keeps it until the end
+
+	uint8_t queued() { return (TX_QUEUE_SIZE + queue_head - queue_tail) % TX_QUEUE_SIZE; }
+	void enqueue(const unsigned char *, size_t);
+	void peek(unsigned char *, size_t);
+
 public:
 	SerialCommand(HardwareSerial *);
 	void set(SerialCommandType, int8_t, int32_t, int32_t);
@@ -64,6 +88,10 @@ public:
 	bool send_sync();
 	bool send_header(int16_t); // OK header: payload_size == 0; FAIL header: payload_size == -1
 	bool send_payload(const unsigned char *, size_t);
+	bool send_background(const unsigned char *, int16_t);  // false - the link is busy, the frame must wait
+	bool sending_background() { return frame_left > 0 && frame_payload != NULL; }
+	bool queue_empty() { return queue_head == queue_tail; }
+	void transmit();
 };
 
 inline bool SerialCommand::read()
@@ -9,6 +9,11 @@ uint32_t read_vcc()
 {
 	uint8_t low, high;
 	uint32_t res;
+	uint8_t adcsra = ADCSRA, admux = ADMUX;
+
+	// the RNG samples in free running mode, stop it for a single conversion
+	ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+	while (bit_is_set(ADCSRA, ADSC));
 
 	// REFS: 01 - reference AVCC with external capacitor at AREF pin
 	// MUX: 1110 - input channel 1.1V (Vbg)
@@ -23,6 +28,11 @@ uint32_t read_vcc()
 	high = ADCH;
 	res = (high << 8) | low;
 
+	// restart the RNG sampling; ADIF is cleared by writing one
+	ADMUX = admux;
+	ADCSRA = adcsra | _BV(ADIF);
+	if (bit_is_set(adcsra, ADATE)) ADCSRA |= _BV(ADSC);
+
 	if (res > 0) res = 1125300L / res;  // calculate Vcc (in mV); 1125300 = 1.1 * 1023 * 1000
 	else return 0;
 
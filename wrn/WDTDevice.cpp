@@ -3,7 +3,6 @@
 
 #include <avr/io.h>
 #include <stdio.h>
-#include <util/delay.h>
 #include "WDTDevice.h"
 #include "EepromLog.h"
 #include "Time.h"
@@ -14,7 +13,8 @@
 #define WDT_TIMEOUT_MAX 300  // sec
 
 
-WDTDevice::WDTDevice() : active(false), timeout(WDT_TIMEOUT_DEFAULT), min_delta(WDT_TIMEOUT_DEFAULT), keep_alive_uptime(0)
+WDTDevice::WDTDevice() : active(false), timeout(WDT_TIMEOUT_DEFAULT), min_delta(WDT_TIMEOUT_DEFAULT), keep_alive_uptime(0),
+	pulse(false), pulse_start(0), log_pending(false), log_index(0), log_limit(0), log_first(0)
 {
 	DDRC |= _BV(DDC1);  // RESET:OUTPUT
 	PORTC &= ~_BV(PORTC1);  // RESET:LOW
@@ -39,7 +39,7 @@ bool WDTDevice::run(SerialCommand *cmd)
 	case WDT_TIMEOUT:  // W3:180
 		if (!set_timeout(cmd->get_arg1())) return false;
 		break;
-	case WDT_LOG:  // W4:10
+	case WDT_LOG:  // W4:10:0
 		if (!send_log(cmd)) return false;
 		break;
 	default:
@@ -74,28 +74,58 @@ bool WDTDevice::send_status(SerialCommand *cmd)
 	return send(cmd, (const unsigned char *)&status, sizeof status);
 }
 
+// W4:n:start - the last n records (0 - all) from the index start; the frame takes a page,
+// the next pages are sent from the main loop between the other frames
 bool WDTDevice::send_log(SerialCommand *cmd)
 {
-	uint16_t size, num, n;
-	bool ret = true;  // empty log it's perfectly normal
+	WDTLogPage page;
+	uint16_t num, n, start, count;
 	LogRecord *record;
+	bool paging = log_pending;
 
 	num = sys_log.length();
 	n = (uint16_t)cmd->get_arg1();
+	start = (uint16_t)cmd->get_arg2();
 	if (n > 0 && num > n) num = n;
-	size = num * sizeof(LogRecord);
 
-	if (!cmd->send_header(size)) return false;
+	log_pending = false;
+	if (num == 0 && start == 0) return send(cmd);  // empty log it's perfectly normal
 
 	sys_log.set_reverse(false);  // reset cursor
 	sys_log.set_limit(num);
-	for (uint16_t i = 0; i < num; i++) {
+	page.first = sys_log.position();
+	if (paging && start > 0 && page.first != log_first) start = 0;  // the records have moved
+	if (start >= num) return false;
+
+	count = num - start;
+	if (count > WDT_LOG_PAGE) count = WDT_LOG_PAGE;
+	page.index = start;
+	page.total = num;
+
+	if (!cmd->send_header(sizeof page + count * sizeof(LogRecord))) return false;
+	if (!cmd->send_payload((const unsigned char *)&page, sizeof page)) return false;
+
+	sys_log.skip(start);
+	for (uint16_t i = 0; i < count; i++) {
 		record = sys_log.read();
 		IF_DEBUG(printf_P(PSTR("Payload [WDT:LogRecord] Time:%ld; Event:%u\r\n"),
 			record->time, record->log_event));
-		ret = cmd->send_payload((const unsigned char *)record, sizeof(LogRecord));
-		if (!ret) break;
+		if (!cmd->send_payload((const unsigned char *)record, sizeof(LogRecord))) return false;
 	}
 
-	return ret;
+	log_index = start + count;
+	log_limit = n;
+	log_first = page.first;
+	log_pending = log_index < num;
+
+	return true;
+}
+
+// the command of the next page, run() sends it when the previous one has left the TX queue
+bool WDTDevice::read(SerialCommand *cmd)
+{
+	if (!log_pending || !cmd->queue_empty()) return false;
+
+	cmd->set(CMD_WDT, WDT_LOG, log_limit, log_index);
+	return true;
 }
@@ -10,13 +10,15 @@
 #include "EepromLog.h"
 #include "Time.h"
 
+#define WDT_RESET_PULSE 1000  // ms, the RESET line of the host is held HIGH
+#define WDT_LOG_PAGE 16  // records per frame of W4
 
 enum WDTCommand {
 	WDT_KEEP_ALIVE = 0,
 	WDT_DEACTIVATE,
 	WDT_STATUS,
 	WDT_TIMEOUT,
-	WDT_LOG,
+	WDT_LOG,  // W4:n:start, WDTLogPage and the records
 	WDT_UNKNOWN
 };
 
@@ -28,6 +30,15 @@ struct WDTStatusPayload
 	uint16_t log_length;
 };
 
+// The log is sent in pages, the host asks for the rest from the index it has not got.
+// A record written between the pages moves the first one, the transfer starts again.
+struct WDTLogPage
+{
+	uint16_t index;  // of the first record of the page
+	uint16_t total;  // records of the request
+	uint16_t first;  // the EEPROM slot of the record 0
+};
+
 class WDTDevice : public Device
 {
 protected:
@@ -35,6 +46,12 @@ protected:
 	uint16_t timeout;
 	uint16_t min_delta;  // 0 - last reboot was caused by the watchdog
 	uint32_t keep_alive_uptime;
+	bool pulse;  // the RESET line is HIGH
+	uint32_t pulse_start;  // ms
+	bool log_pending;  // the next page is sent from the main loop
+	uint16_t log_index;
+	uint16_t log_limit;  // n of W4
+	uint16_t log_first;
 
 	bool set_timeout(int32_t);
 	bool send_status(SerialCommand *);
@@ -43,13 +60,23 @@ protected:
 public:
 	WDTDevice();
 	bool run(SerialCommand *);
+	bool read(SerialCommand *);
 	void update();
 };
 
+// the reset pulse is timed by millis, the main loop goes on while it lasts
 inline void WDTDevice::update()
 {
 	int32_t delta;
 
+	if (pulse) {
+		if (sys_time.millis() - pulse_start >= WDT_RESET_PULSE) {
+			PORTC &= ~_BV(PORTC1);  // RESET:LOW
+			pulse = false;
+		}
+		return;
+	}
+
 	if (active) {
 		delta = timeout - (sys_time.get_uptime() - keep_alive_uptime);
 		if (min_delta > delta) min_delta = delta;
@@ -59,8 +86,8 @@ inline void WDTDevice::update()
 			min_delta = 0;
 
 			PORTC |= _BV(PORTC1);  // RESET:HIGH
-			_delay_ms(1000);
-			PORTC &= ~_BV(PORTC1);  // RESET:LOW
+			pulse_start = sys_time.millis();
+			pulse = true;
 
 			sys_log.write(sys_time.now(), LOG_RESET);
 		}
@@ -0,0 +1,325 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// Runs the command parser, the calibration of the RNG, the EEPROM log, the scheduler
+// and the TX queue of the firmware on the host and reports the time per operation and the traffic of the
+// simulated peripherals. The host time is not the AVR time, but the changes of the
+// firmware code show up in both.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "Host.h"
+#include "HardwareSerial.h"
+#include "SerialCommand.h"
+#include "Devices.h"
+#include "WDTDevice.h"
+#include "RNGDevice.h"
+#include "EepromLog.h"
+#include "Scheduler.h"
+
+#define BENCH_COMMANDS 200000
+#define BENCH_CALIBRATIONS 200
+#define BENCH_CALIBRATION_LIMIT 65536  // samples, the calibration has failed after it
+#define BENCH_FLOOD_SAMPLES 2000000
+#define BENCH_LOG_RECORDS ((E2END + 1 - 2 * sizeof(LogHeader)) / sizeof(LogRecord) - 1)  // a full log
+#define BENCH_LOG_PASSES 2000
+#define BENCH_SCHED_ROUNDS 200
+#define BENCH_LINK_MS 2000  // of the simulated wire
+#define BENCH_LINK_BYTES 6  // per ms, 57600 baud
+#define BENCH_LINK_SAMPLES 12  // per ms, the ADC
+#define BENCH_LINK_REQUEST 100  // ms between the commands
+
+SerialCommand cmd(&sys_serial);
+WDTDevice wdt_device;
+RNGDevice rng_device;
+NRFDevice nrf_device;
+
+static const char *commands[] = {
+	"C0:8\n", "C1:1460792071\n", "C2\n", "W0\n", "W3:300\n", "W4:10\n", "R2\n", "R3:2\n", "R8:32\n", "X1\n"
+};
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Box-Muller, the noise of the source is near the middle of the scale
+static uint16_t gaussian_sample(double mean, double sigma)
+{
+	double u1 = (rand() + 1.0) / (RAND_MAX + 2.0), u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double v = mean + sigma * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+
+	if (v < 0) return 0;
+	if (v > 1023) return 1023;
+	return (uint16_t)v;
+}
+
+// the loop of main() for the RNG
+static void process_samples()
+{
+	for (uint8_t i = rng_device.available(); i > 0; i--) {
+		if (rng_device.read(&cmd)) {
+			if (!rng_device.run(&cmd)) cmd.send_header(-1);
+		}
+	}
+	rng_device.drain(&cmd);
+}
+
+// the calibrated flag of the status payload, -1 if there is no status
+static int calibrated()
+{
+	unsigned char frame[sizeof(PayloadHeader) + sizeof(RNGStatusPayload)];
+	PayloadHeader *header = (PayloadHeader *)frame;
+
+	host_serial_clear();
+	cmd.set(CMD_RNG, RNG_STATUS, 0, 0);
+	if (!rng_device.run(&cmd)) return -1;
+	if (host_serial_sent(frame, sizeof frame) != sizeof frame || header->payload_size != sizeof(RNGStatusPayload))
+		return -1;
+	return ((RNGStatusPayload *)(frame + sizeof(PayloadHeader)))->calibrated;
+}
+
+static bool bench_parser()
+{
+	unsigned long parsed = 0;
+	size_t n = sizeof commands / sizeof commands[0];
+	double t;
+
+	host_reset_stats();
+	t = now();
+	for (unsigned long i = 0; i < BENCH_COMMANDS; i++) {
+		host_serial_receive(commands[i % n]);
+		while (cmd.read()) {
+			if (cmd.get_type() != CMD_UNKNOWN) parsed++;
+		}
+	}
+	t = now() - t;
+
+	printf("parser       %.0f ns per command; %lu of %u parsed\n", t * 1e9 / BENCH_COMMANDS, parsed, BENCH_COMMANDS);
+	return parsed == BENCH_COMMANDS / n * (n - 1);
+}
+
+static bool bench_calibration()
+{
+	unsigned long samples = 0, worst = 0, failed = 0, n;
+	double t = 0, t0;
+
+	for (int i = 0; i < BENCH_CALIBRATIONS; i++) {
+		rng_device = RNGDevice();  // as after the boot
+
+		// the status is checked per buffer of samples, as often as the main loop could do it
+		for (n = 0; n < BENCH_CALIBRATION_LIMIT; n += RNG_SAMPLE_BUFFER_SIZE / 2) {
+			t0 = now();
+			for (int j = 0; j < RNG_SAMPLE_BUFFER_SIZE / 2; j++) host_adc_sample(gaussian_sample(512 + i, 8));
+			process_samples();
+			t += now() - t0;
+			if (calibrated() == 1) break;
+		}
+		if (n >= BENCH_CALIBRATION_LIMIT) failed++;
+		samples += n;
+		if (worst < n) worst = n;
+	}
+
+	printf("calibration  %lu samples (worst %lu); %.0f ns per sample; %lu failed\n",
+		samples / BENCH_CALIBRATIONS, worst, t * 1e9 / samples, failed);
+	return failed == 0;
+}
+
+static bool bench_flood()
+{
+	double t;
+
+	rng_device = RNGDevice();  // the threshold of the last calibration is far away
+	cmd.set(CMD_RNG, RNG_FLOOD_ON, 0, 0);
+	rng_device.run(&cmd);
+	host_reset_stats();
+	t = now();
+	for (unsigned long i = 0; i < BENCH_FLOOD_SAMPLES; i += RNG_SAMPLE_BUFFER_SIZE / 2) {
+		for (int j = 0; j < RNG_SAMPLE_BUFFER_SIZE / 2; j++) host_adc_sample(gaussian_sample(512, 8));
+		process_samples();
+	}
+	t = now() - t;
+	cmd.set(CMD_RNG, RNG_FLOOD_OFF, 0, 0);
+	rng_device.run(&cmd);
+
+	printf("flood        %.0f ns per sample; %.3f bytes sent per sample\n",
+		t * 1e9 / BENCH_FLOOD_SAMPLES, (double)host_stats.tx_bytes / BENCH_FLOOD_SAMPLES);
+	return host_stats.tx_bytes > 0;
+}
+
+static bool bench_log()
+{
+	unsigned long begin_read, log_read, sent, pages;
+	uint16_t length;
+	double t_begin, t_log;
+	bool ok = true;
+
+	sys_log.begin();  // the size of the log is set, the header is repaired
+	host_eeprom_ready();
+	sys_log.clean();
+	while (!sys_log.update()) host_eeprom_ready();  // the main loop erases the EEPROM
+	for (unsigned long i = 0; i < BENCH_LOG_RECORDS; i++) {
+		sys_log.write(1460792071 + i, LOG_BOOT + i % 2);
+		host_eeprom_ready();
+	}
+
+	host_reset_stats();
+	t_begin = now();
+	for (int i = 0; i < BENCH_LOG_PASSES; i++) ok &= sys_log.begin();
+	t_begin = now() - t_begin;
+	begin_read = host_stats.eeprom_read / BENCH_LOG_PASSES;
+	length = sys_log.length();
+
+	host_reset_stats();
+	t_log = now();
+	for (int i = 0; i < BENCH_LOG_PASSES; i++) {
+		cmd.set(CMD_WDT, WDT_LOG, 0, 0);
+		ok &= wdt_device.run(&cmd);
+		while (wdt_device.read(&cmd)) ok &= wdt_device.run(&cmd);  // the pages of the main loop
+	}
+	t_log = now() - t_log;
+	log_read = host_stats.eeprom_read / BENCH_LOG_PASSES;
+	sent = host_stats.tx_bytes / BENCH_LOG_PASSES;
+
+	printf("log begin    %.0f ns; %lu EEPROM bytes read for %u records\n", t_begin * 1e9 / BENCH_LOG_PASSES, begin_read, length);
+	printf("log W4       %.0f ns; %lu EEPROM bytes read; %lu bytes sent\n", t_log * 1e9 / BENCH_LOG_PASSES, log_read, sent);
+	pages = (length + WDT_LOG_PAGE - 1) / WDT_LOG_PAGE;
+	return ok && length == BENCH_LOG_RECORDS
+		&& sent == pages * (sizeof(PayloadHeader) + sizeof(WDTLogPage)) + length * sizeof(LogRecord);
+}
+
+// the samples come faster than they are processed, only the budget ends the task
+static bool sched_rng()
+{
+	host_adc_sample(gaussian_sample(512, 8));
+	process_samples();
+	return true;
+}
+
+static bool sched_idle()
+{
+	return false;
+}
+
+static bool bench_scheduler()
+{
+	Task tasks[TASK_NUM] = {
+		{sched_idle, 0, false},
+		{sched_rng, SCHED_RNG_BUDGET, true},
+		{sched_idle, 0, false},
+		{sched_idle, 0, false}
+	};
+	SchedulerStatsPayload idle, busy;
+
+	sys_scheduler.begin(tasks);
+	rng_device = RNGDevice();
+	cmd.set(CMD_RNG, RNG_FLOOD_ON, 0, 0);
+	rng_device.run(&cmd);
+
+	for (int i = 0; i < BENCH_SCHED_ROUNDS; i++) sys_scheduler.run();
+	sys_scheduler.get_stats(&idle);
+
+	host_serial_receive("R2\n");  // a command is waiting, the RNG budget is cut
+	for (int i = 0; i < BENCH_SCHED_ROUNDS; i++) sys_scheduler.run();
+	sys_scheduler.get_stats(&busy);
+	while (!cmd.read()) {};
+
+	cmd.set(CMD_RNG, RNG_FLOOD_OFF, 0, 0);
+	rng_device.run(&cmd);
+
+	printf("scheduler    %.1f RNG runs per round; %.1f while the serial is busy; %u rounds cut\n",
+		(double)idle.tasks[TASK_RNG].runs / idle.rounds, (double)busy.tasks[TASK_RNG].runs / busy.rounds,
+		busy.tasks[TASK_RNG].cuts);
+	return idle.rounds == BENCH_SCHED_ROUNDS && idle.tasks[TASK_RNG].cuts == 0 && idle.tasks[TASK_NRF].runs == BENCH_SCHED_ROUNDS
+		&& busy.tasks[TASK_RNG].cuts == BENCH_SCHED_ROUNDS && busy.tasks[TASK_RNG].runs < idle.tasks[TASK_RNG].runs;
+}
+
+// the bytes on the wire up to the end of the R2 response since the capture was cleared, 0 - not yet
+static size_t response_end()
+{
+	static unsigned char wire[HOST_TX_CAPTURE_SIZE];
+	size_t n = host_serial_sent(wire, sizeof wire), end;
+	PayloadHeader *header;
+
+	for (size_t i = 0; i + sizeof(PayloadHeader) <= n; i++) {
+		header = (PayloadHeader *)(wire + i);
+		end = i + sizeof(PayloadHeader) + sizeof(RNGStatusPayload);
+		if (header->type_id == CMD_RNG && header->cmd_id == RNG_STATUS
+				&& header->payload_size == sizeof(RNGStatusPayload) && end <= n) return end;
+	}
+	return 0;
+}
+
+// The flood of RNG_SAMPLE_BITS_MAX bits per sample is faster than the link, the RNG frames always wait for it.
+// A command response waits only for the RNG frame on the link.
+static bool bench_link()
+{
+	unsigned long wire = 0, requests = 0, latency = 0, worst = 0, bound;
+	size_t end;
+	bool waiting = false;
+
+	rng_device = RNGDevice();
+	cmd.set(CMD_RNG, RNG_SAMPLE_BITS, RNG_SAMPLE_BITS_MAX, 0);
+	rng_device.run(&cmd);
+	cmd.set(CMD_RNG, RNG_FLOOD_ON, 0, 0);
+	rng_device.run(&cmd);
+	host_serial_hold(true);
+
+	for (int ms = 0; ms < BENCH_LINK_MS; ms++) {
+		for (int i = 0; i < BENCH_LINK_SAMPLES; i++) host_adc_sample(gaussian_sample(512, 8));
+		process_samples();
+		cmd.transmit();
+
+		if (!waiting && ms % BENCH_LINK_REQUEST == BENCH_LINK_REQUEST / 2) {
+			host_serial_clear();
+			host_serial_receive("R2\n");
+			while (cmd.read()) rng_device.run(&cmd);
+			waiting = true;
+		}
+
+		wire += host_serial_wire(BENCH_LINK_BYTES);
+		if (waiting && (end = response_end()) > 0) {
+			latency += end;
+			if (worst < end) worst = end;
+			requests++;
+			waiting = false;
+		}
+	}
+
+	cmd.set(CMD_RNG, RNG_FLOOD_OFF, 0, 0);
+	rng_device.run(&cmd);
+	do {
+		rng_device.drain(&cmd);
+	} while (host_serial_wire(SERIAL_TX_BUFFER_SIZE) > 0);
+	host_serial_hold(false);
+
+	// the rest of the RNG frame, the TX buffer may still hold the end of the previous one
+	bound = RNG_PAYLOAD_SIZE + 2 * sizeof(PayloadHeader) + TX_BACKGROUND_AHEAD
+		+ sizeof(PayloadHeader) + sizeof(RNGStatusPayload);
+	printf("link         %.1f%% of the wire used; R2 response after %.0f bytes (worst %lu, bound %lu)\n",
+		100.0 * wire / (BENCH_LINK_MS * BENCH_LINK_BYTES), requests ? (double)latency / requests : 0.0, worst, bound);
+	return requests == BENCH_LINK_MS / BENCH_LINK_REQUEST && worst <= bound
+		&& wire >= BENCH_LINK_MS * BENCH_LINK_BYTES * 9 / 10;
+}
+
+int main()
+{
+	bool ok = true;
+
+	srand(1);
+	ok &= bench_parser();
+	ok &= bench_calibration();
+	ok &= bench_flood();
+	ok &= bench_log();
+	ok &= bench_scheduler();
+	ok &= bench_link();
+
+	if (!ok) fprintf(stderr, "The firmware does not behave as expected.\n");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,159 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#include <string.h>
+#include <time.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include "Host.h"
+
+// the reset values of the datasheet
+volatile uint8_t UCSR0A = _BV(UDRE0), UCSR0B = 0, UCSR0C = _BV(UCSZ01) | _BV(UCSZ00), UBRR0H = 0, UBRR0L = 0;
+volatile uint8_t ADMUX = 0, ADCSRA = 0, ADCSRB = 0, ADCL = 0, ADCH = 0;
+volatile uint16_t ADC = 0;
+volatile uint8_t TCCR0A = 0, TCCR0B = 0, TIMSK0 = 0, TCNT0 = 0;
+volatile uint8_t TCCR1A = 0, TCCR1B = 0;
+volatile uint8_t PORTC = 0, DDRC = 0, PINC = 0;
+volatile uint8_t PORTD = 0, DDRD = 0, PIND = 0xFF;  // the inputs are pulled up
+volatile uint8_t EICRA = 0, EIMSK = 0, EIFR = 0;
+volatile uint8_t SREG = 0, MCUSR = 0;
+volatile uint8_t EECR = 0, EEDR = 0;
+volatile uint16_t EEAR = 0;
+
+HostUDR UDR0;
+HostTCNT1 TCNT1;
+HostStats host_stats;
+uint8_t host_eeprom[E2END + 1];
+
+static unsigned char rx_byte;
+static unsigned char tx_capture[HOST_TX_CAPTURE_SIZE];
+static size_t tx_len = 0;
+
+// UDRE0 is cleared only by host_serial_hold(), otherwise the bytes go to the wire at once
+// and the TX buffer stays empty
+HostUDR &HostUDR::operator=(uint8_t c)
+{
+	if (tx_len == sizeof tx_capture) {
+		memmove(tx_capture, tx_capture + sizeof tx_capture / 2, sizeof tx_capture / 2);
+		tx_len = sizeof tx_capture / 2;
+	}
+	tx_capture[tx_len++] = c;
+	host_stats.tx_bytes++;
+	return *this;
+}
+
+HostUDR::operator uint8_t() const
+{
+	return rx_byte;
+}
+
+// the prescaler is not checked, the firmware sets only CLKio/64
+HostTCNT1::operator uint16_t() const
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint16_t)((ts.tv_sec * 1000000000ULL + ts.tv_nsec) * (F_CPU / 1000000) / 1000 / 64);
+}
+
+void host_serial_receive(const char *s)
+{
+	while (*s) {
+		rx_byte = *s++;
+		USART_RX_vect();
+	}
+}
+
+size_t host_serial_sent(unsigned char *buffer, size_t size)
+{
+	size_t n = tx_len < size ? tx_len : size;
+
+	memcpy(buffer, tx_capture + tx_len - n, n);
+	return n;
+}
+
+void host_serial_clear()
+{
+	tx_len = 0;
+}
+
+void host_serial_hold(bool hold)
+{
+	if (hold) UCSR0A &= ~_BV(UDRE0);
+	else UCSR0A |= _BV(UDRE0);
+}
+
+size_t host_serial_wire(size_t n)
+{
+	size_t sent = 0;
+
+	for (; sent < n && (UCSR0B & _BV(UDRIE0)); sent++) USART_UDRE_vect();
+	return sent;
+}
+
+void host_adc_sample(uint16_t sample)
+{
+	ADC = sample;
+	ADCL = sample & 0xFF;
+	ADCH = sample >> 8;
+	ADC_vect();
+}
+
+// a write started by the handler is done at once, so the EEPROM is always ready
+void host_eeprom_ready()
+{
+	while (EECR & _BV(EERIE)) {
+		EE_READY_vect();
+		if (EECR & _BV(EEPE)) {
+			host_stats.eeprom_written++;
+			host_eeprom[EEAR & E2END] = EEDR;
+			EECR &= ~(_BV(EEMPE) | _BV(EEPE));
+		}
+	}
+}
+
+void host_reset_stats()
+{
+	memset(&host_stats, 0, sizeof host_stats);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *p)
+{
+	host_stats.eeprom_read++;
+	return host_eeprom[(uintptr_t)p & E2END];
+}
+
+uint32_t eeprom_read_dword(const uint32_t *p)
+{
+	uint32_t v;
+
+	eeprom_read_block(&v, p, sizeof v);
+	return v;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++) ((uint8_t *)dst)[i] = eeprom_read_byte((const uint8_t *)src + i);
+}
+
+void eeprom_write_byte(uint8_t *p, uint8_t v)
+{
+	host_stats.eeprom_written++;
+	host_eeprom[(uintptr_t)p & E2END] = v;
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t v)
+{
+	if (eeprom_read_byte(p) != v) eeprom_write_byte(p, v);
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++) eeprom_write_byte((uint8_t *)dst + i, ((const uint8_t *)src)[i]);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++) eeprom_update_byte((uint8_t *)dst + i, ((const uint8_t *)src)[i]);
+}
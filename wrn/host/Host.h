@@ -0,0 +1,34 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// The simulated peripherals of the host build.
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <avr/io.h>
+
+#define HOST_TX_CAPTURE_SIZE 4096  // the last bytes sent by the device
+
+struct HostStats
+{
+	unsigned long tx_bytes;
+	unsigned long eeprom_read;  // bytes
+	unsigned long eeprom_written;
+};
+
+extern HostStats host_stats;
+extern uint8_t host_eeprom[E2END + 1];
+
+void host_serial_receive(const char *);  // the bytes come through the RX interrupt
+size_t host_serial_sent(unsigned char *, size_t);  // copies the capture, returns its length
+void host_serial_clear();
+void host_serial_hold(bool);  // the wire takes only the bytes of host_serial_wire()
+size_t host_serial_wire(size_t);  // up to n bytes of the TX buffer go out, returns their number
+void host_adc_sample(uint16_t);  // a conversion completes
+void host_eeprom_ready();  // the EE_READY interrupt runs until it is disabled
+void host_reset_stats();
+
+#endif /* HOST_H_ */
@@ -0,0 +1,9 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef HOST_RF24_H_
+#define HOST_RF24_H_
+
+#include "RF24Network.h"
+
+#endif /* HOST_RF24_H_ */
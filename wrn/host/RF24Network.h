@@ -0,0 +1,37 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// The radio is not simulated: the network has no messages.
+
+#ifndef HOST_RF24NETWORK_H_
+#define HOST_RF24NETWORK_H_
+
+#include <inttypes.h>
+
+class RF24
+{
+public:
+	bool begin() { return false; }
+};
+
+struct RF24NetworkHeader
+{
+	uint16_t from_node;
+	uint16_t to_node;
+	uint16_t id;
+	unsigned char type;
+	unsigned char reserved;
+};
+
+class RF24Network
+{
+public:
+	RF24Network(RF24 *) {}
+	void begin(uint8_t, uint16_t) {}
+	uint8_t update() { return 0; }
+	bool available() { return false; }
+	uint16_t peek(RF24NetworkHeader &) { return 0; }
+	uint16_t read(RF24NetworkHeader &, void *, uint16_t) { return 0; }
+};
+
+#endif /* HOST_RF24NETWORK_H_ */
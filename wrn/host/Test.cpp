@@ -0,0 +1,307 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// Checks the outputs of the firmware on the host: the extractors on fixed input, the trip
+// points of the health tests, the raw capture, the wrap, the clean and the repair of the
+// EEPROM log. Every failed check is printed, the exit code is the result.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Host.h"
+#include "HardwareSerial.h"
+#include "SerialCommand.h"
+#include "Devices.h"
+#include "WDTDevice.h"
+#include "RNGDevice.h"
+#include "EepromLog.h"
+
+#define TEST_SAMPLES 1000
+#define TEST_LOG_SIZE ((E2END + 1 - 2 * sizeof(LogHeader)) / sizeof(LogRecord) * sizeof(LogRecord))
+#define TEST_LOG_RECORDS (TEST_LOG_SIZE / sizeof(LogRecord) - 1)  // the marker takes a slot
+#define TEST_LOG_TIME 1460792071
+
+SerialCommand cmd(&sys_serial);
+WDTDevice wdt_device;
+RNGDevice rng_device;
+NRFDevice nrf_device;
+
+static unsigned int checks, failures;
+
+static void check(bool ok, const char *what)
+{
+	checks++;
+	if (ok) return;
+	failures++;
+	printf("FAIL %s\n", what);
+}
+
+// the bits go to the extractor and the health tests one by one, as from read()
+class TestRNG : public RNGDevice
+{
+public:
+	TestRNG(RNGExtractor e) { set_extractor(e); }
+	void feed(const char *bits) { for (; *bits; bits++) extract(*bits == '1'); }
+	void feed(bool bit, uint16_t n) { while (n-- > 0) extract(bit); }
+	uint32_t emitted() { return emitted_bits; }
+	uint8_t output() { return byte; }  // the last bits, the newest at the lowest
+	uint8_t health_bits() { return health; }
+	uint16_t failures() { return health_failures; }
+};
+
+// 1024 bits starting with 1, the zeros are spread evenly, so RCT never trips
+static void feed_window(TestRNG &rng, uint16_t zeros)
+{
+	for (uint32_t i = 0; i < RNG_APT_WINDOW; i++)
+		rng.feed((i + 1) * zeros / RNG_APT_WINDOW == i * zeros / RNG_APT_WINDOW, 1);
+}
+
+static void test_extractors()
+{
+	TestRNG neumann(RNG_EXTRACTOR_VON_NEUMANN), neumann2(RNG_EXTRACTOR_VON_NEUMANN), peres(RNG_EXTRACTOR_PERES);
+
+	neumann.feed("0110001110010110");  // 01 10 00 11 10 01 01 10
+	check(neumann.emitted() == 6 && neumann.output() == 0x19, "von Neumann: 01 -> 0, 10 -> 1, 00 and 11 dropped");
+
+	// the same pairs: von Neumann takes only 01, Peres also the XOR and the equal pairs
+	neumann2.feed("11011100");
+	check(neumann2.emitted() == 1 && neumann2.output() == 0x00, "von Neumann: 11 01 11 00");
+	peres.feed("11011100");
+	check(peres.emitted() == 3 && peres.output() == 0x01, "Peres: 11 01 11 00 -> 001");
+}
+
+static void test_health()
+{
+	TestRNG rct(RNG_EXTRACTOR_VON_NEUMANN), apt_pass(RNG_EXTRACTOR_VON_NEUMANN), apt_fail(RNG_EXTRACTOR_VON_NEUMANN);
+
+	rct.feed(true, RNG_RCT_CUTOFF - 1);
+	check(rct.health_bits() == RNG_HEALTH_OK, "RCT: a run below the cutoff passes");
+	rct.feed(true, 1);
+	check(rct.health_bits() == RNG_HEALTH_RCT && rct.failures() == 1, "RCT: the run of the cutoff fails");
+	rct.feed(false, 1);
+	rct.feed(true, RNG_RCT_CUTOFF);  // the next run fails again
+	check(rct.failures() == 1, "RCT: a latched failure is counted once");
+
+	feed_window(apt_pass, RNG_APT_WINDOW - (RNG_APT_CUTOFF - 1));
+	check(apt_pass.health_bits() == RNG_HEALTH_OK, "APT: the cutoff - 1 equal bits pass");
+	feed_window(apt_fail, RNG_APT_WINDOW - RNG_APT_CUTOFF);
+	check(apt_fail.health_bits() == RNG_HEALTH_APT && apt_fail.failures() == 1, "APT: the cutoff equal bits fail");
+}
+
+// the loop of main() for the RNG
+static void process_samples()
+{
+	for (uint8_t i = rng_device.available(); i > 0; i--) {
+		if (rng_device.read(&cmd)) {
+			if (!rng_device.run(&cmd)) cmd.send_header(-1);
+		}
+	}
+	rng_device.drain(&cmd);
+}
+
+static void feed_samples()
+{
+	for (int i = 0; i < TEST_SAMPLES; i++) {
+		host_adc_sample(512 + i % 16);
+		process_samples();
+	}
+}
+
+static void test_raw()
+{
+	rng_device = RNGDevice();
+	cmd.set(CMD_RNG, RNG_RAW, 1, 0);
+	rng_device.run(&cmd);
+	cmd.set(CMD_RNG, RNG_FLOOD_ON, 0, 0);
+	rng_device.run(&cmd);
+	host_reset_stats();
+	feed_samples();
+	check(host_stats.tx_bytes > 0, "raw: the samples are sent while the flood is on");
+
+	cmd.set(CMD_RNG, RNG_FLOOD_OFF, 0, 0);
+	rng_device.run(&cmd);
+	process_samples();  // the frame on the link is completed
+	host_reset_stats();
+	feed_samples();
+	check(host_stats.tx_bytes == 0, "raw: R1 stops the frames");
+}
+
+// as after a reset: the queued writes are done, the RAM is lost
+static bool reboot()
+{
+	bool ok;
+
+	host_eeprom_ready();
+	sys_log = Log();
+	ok = sys_log.begin();
+	host_eeprom_ready();
+	return ok;
+}
+
+static void new_log()
+{
+	memset(host_eeprom, 0, sizeof host_eeprom);
+	reboot();
+}
+
+static void write_records(int32_t time, uint16_t n)
+{
+	for (uint16_t i = 0; i < n; i++) {
+		sys_log.write(time + i, LOG_BOOT);
+		host_eeprom_ready();
+	}
+}
+
+// the number of the records, the time of the first and the last one
+static uint16_t read_records(int32_t *first, int32_t *last)
+{
+	LogRecord *record;
+	uint16_t n = 0;
+
+	sys_log.set_reverse(false);
+	while ((record = sys_log.read()) != NULL) {
+		if (n++ == 0) *first = record->time;
+		*last = record->time;
+	}
+	return n;
+}
+
+// the main loop erases the EEPROM; true if the end is confirmed
+static bool finish_clean()
+{
+	bool confirmed = false;
+
+	for (unsigned int i = 0; i < 2 * TEST_LOG_SIZE && sys_log.is_cleaning(); i++) {
+		confirmed |= sys_log.update();
+		host_eeprom_ready();
+	}
+	return confirmed;
+}
+
+static bool erased(size_t from)
+{
+	for (size_t i = from; i < TEST_LOG_SIZE; i++) {
+		if (host_eeprom[i] != 0) return false;
+	}
+	return true;
+}
+
+static void lose_headers()
+{
+	memset(host_eeprom + TEST_LOG_SIZE, 0xFF, 2 * sizeof(LogHeader));
+}
+
+static void test_log_wrap()
+{
+	int32_t first = 0, last = 0;
+
+	new_log();
+	write_records(TEST_LOG_TIME, TEST_LOG_RECORDS + 5);
+	check(read_records(&first, &last) == TEST_LOG_RECORDS && first == TEST_LOG_TIME + 5
+		&& last == TEST_LOG_TIME + TEST_LOG_RECORDS + 4, "log: the oldest records are overwritten");
+	check(reboot() && sys_log.length() == TEST_LOG_RECORDS, "log: the wrapped log is read from the header");
+}
+
+static void test_log_wear()
+{
+	uint8_t headers[2 * sizeof(LogHeader)], before[E2END + 1];
+	int32_t first = 0, last = 0;
+
+	new_log();
+	memcpy(headers, host_eeprom + TEST_LOG_SIZE, sizeof headers);
+	write_records(TEST_LOG_TIME, 10);
+	check(memcmp(headers, host_eeprom + TEST_LOG_SIZE, sizeof headers) == 0, "log: a record does not write the header");
+	check(reboot() && read_records(&first, &last) == 10 && last == TEST_LOG_TIME + 9,
+		"log: the records after the end of the header are followed");
+	host_reset_stats();
+	write_records(TEST_LOG_TIME, 1);
+	check(host_stats.eeprom_written <= sizeof(LogRecord), "log: the bytes in place are not programmed");
+
+	// a full log, the reset comes after the new marker, before its record
+	write_records(TEST_LOG_TIME, TEST_LOG_RECORDS);
+	memcpy(before, host_eeprom, sizeof before);
+	write_records(TEST_LOG_TIME + TEST_LOG_RECORDS, 1);
+	for (size_t i = 0; i < TEST_LOG_SIZE; i++) {
+		if (before[i] == 0) host_eeprom[i] = 0;
+	}
+	check(reboot() && read_records(&first, &last) == TEST_LOG_RECORDS - 1 && first == TEST_LOG_TIME + 1
+		&& last == TEST_LOG_TIME + TEST_LOG_RECORDS - 1, "log: the marker without its record drops the oldest one");
+}
+
+static void test_log_header()
+{
+	uint8_t headers[2 * sizeof(LogHeader)];
+	int32_t first = 0, last = 0;
+
+	new_log();
+	write_records(TEST_LOG_TIME, 10);
+	lose_headers();
+	check(reboot() && read_records(&first, &last) == 10 && first == TEST_LOG_TIME, "log: the scan repairs the headers");
+	host_reset_stats();
+	check(reboot() && host_stats.eeprom_read == 2 * sizeof(LogHeader) + 2 * sizeof(LogRecord),
+		"log: the repaired header is written back");  // the marker and the oldest record
+
+	// the reset comes after the record and its marker, before the header
+	memcpy(headers, host_eeprom + TEST_LOG_SIZE, sizeof headers);
+	write_records(TEST_LOG_TIME + 10, 1);
+	memcpy(host_eeprom + TEST_LOG_SIZE, headers, sizeof headers);
+	check(reboot() && read_records(&first, &last) == 11 && last == TEST_LOG_TIME + 10,
+		"log: a record without its header is found by the scan");
+}
+
+static void test_log_clean()
+{
+	uint8_t headers[2 * sizeof(LogHeader)];
+	int32_t first = 0, last = 0;
+
+	new_log();
+	write_records(TEST_LOG_TIME, 20);
+	sys_log.clean();
+	check(sys_log.length() == 0, "clean: the log is empty at once");
+	write_records(TEST_LOG_TIME + 20, 3);
+	check(finish_clean() && erased(4 * sizeof(LogRecord)), "clean: the old records are erased, C5 is confirmed");
+	check(reboot() && !sys_log.is_cleaning() && read_records(&first, &last) == 3 && first == TEST_LOG_TIME + 20,
+		"clean: the records written during the erase are kept");
+
+	// a reset during the erase, then another one before the header of a record
+	write_records(TEST_LOG_TIME, 20);
+	sys_log.clean();
+	write_records(TEST_LOG_TIME + 20, 2);
+	for (int i = 0; i < 10; i++) {
+		sys_log.update();
+		host_eeprom_ready();
+	}
+	check(reboot() && sys_log.is_cleaning() && sys_log.length() == 2, "clean: the erase goes on after a reset");
+	memcpy(headers, host_eeprom + TEST_LOG_SIZE, sizeof headers);
+	write_records(TEST_LOG_TIME + 22, 1);
+	memcpy(host_eeprom + TEST_LOG_SIZE, headers, sizeof headers);
+	check(reboot() && sys_log.is_cleaning() && read_records(&first, &last) == 3 && first == TEST_LOG_TIME + 20,
+		"clean: the scan skips the records which are not erased yet");
+	check(!finish_clean() && erased(4 * sizeof(LogRecord)), "clean: the resumed erase is done, not confirmed");
+	check(reboot() && !sys_log.is_cleaning(), "clean: the flag is cleared");
+}
+
+// the log of the layout without the header has no marker the scan could find
+static void test_log_lost()
+{
+	memset(host_eeprom, 0x11, sizeof host_eeprom);
+	check(!reboot() && sys_log.length() == 0, "log: a log the scan cannot follow is dropped");
+	check(!finish_clean() && erased(0), "log: the dropped log is erased, not confirmed");
+	write_records(TEST_LOG_TIME, 1);
+	check(reboot() && sys_log.length() == 1, "log: the new log is kept");
+}
+
+int main()
+{
+	test_extractors();
+	test_health();
+	test_raw();
+	test_log_wrap();
+	test_log_wear();
+	test_log_header();
+	test_log_clean();
+	test_log_lost();
+
+	printf("%u checks, %u failed\n", checks, failures);
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
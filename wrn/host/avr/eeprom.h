@@ -0,0 +1,24 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef HOST_AVR_EEPROM_H_
+#define HOST_AVR_EEPROM_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <avr/io.h>
+
+#define EEMEM
+
+// the EEPROM is an array of Host.cpp, it is always ready
+#define eeprom_is_ready() 1
+
+uint8_t eeprom_read_byte(const uint8_t *);
+uint32_t eeprom_read_dword(const uint32_t *);
+void eeprom_read_block(void *, const void *, size_t);
+void eeprom_write_byte(uint8_t *, uint8_t);
+void eeprom_update_byte(uint8_t *, uint8_t);
+void eeprom_write_block(const void *, void *, size_t);
+void eeprom_update_block(const void *, void *, size_t);
+
+#endif /* HOST_AVR_EEPROM_H_ */
@@ -0,0 +1,22 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef HOST_AVR_INTERRUPT_H_
+#define HOST_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+// an interrupt handler is a function, the host calls it to simulate the interrupt
+#define ISR(vector) void vector(void)
+void USART_RX_vect(void);
+void USART_UDRE_vect(void);
+void ADC_vect(void);
+void TIMER0_OVF_vect(void);
+void EE_READY_vect(void);
+void INT0_vect(void);
+
+// the handlers are never called concurrently with the main code
+#define sei() (SREG |= _BV(SREG_I))
+#define cli() (SREG &= ~_BV(SREG_I))
+
+#endif /* HOST_AVR_INTERRUPT_H_ */
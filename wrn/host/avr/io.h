@@ -0,0 +1,110 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// The registers of the ATmega328P which the firmware uses, for the host build.
+// They are plain variables, the peripherals are simulated by Host.cpp.
+
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <inttypes.h>
+
+#define E2END 0x3FF  // 1KB EEPROM
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+// USART Data Register: the writes go to the simulated wire, the reads return the byte being received
+class HostUDR
+{
+public:
+	HostUDR &operator=(uint8_t);
+	operator uint8_t() const;
+};
+
+// Timer1 Counter: counts the host time in the ticks of CLKio/64
+class HostTCNT1
+{
+public:
+	operator uint16_t() const;
+};
+
+extern HostUDR UDR0;
+extern HostTCNT1 TCNT1;
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UBRR0H, UBRR0L;
+extern volatile uint8_t ADMUX, ADCSRA, ADCSRB, ADCL, ADCH;
+extern volatile uint16_t ADC;
+extern volatile uint8_t TCCR0A, TCCR0B, TIMSK0, TCNT0;
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint8_t PORTC, DDRC, PINC;
+extern volatile uint8_t PORTD, DDRD, PIND;
+extern volatile uint8_t EICRA, EIMSK, EIFR;
+extern volatile uint8_t SREG, MCUSR;
+extern volatile uint8_t EECR, EEDR;
+extern volatile uint16_t EEAR;
+
+// SREG
+#define SREG_I 7
+// UCSR0A
+#define TXC0 6
+#define UDRE0 5
+#define U2X0 1
+// UCSR0B
+#define RXCIE0 7
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+// UCSR0C
+#define UCSZ01 2
+#define UCSZ00 1
+// ADMUX
+#define REFS0 6
+#define ADLAR 5
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+// ADCSRA
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+// TCCR0B, TIMSK0
+#define CS01 1
+#define CS00 0
+#define TOIE0 0
+// TCCR1B
+#define CS12 2
+#define CS11 1
+#define CS10 0
+// EECR
+#define EERIE 3
+#define EEMPE 2
+#define EEPE 1
+#define EERE 0
+// PORTC, DDRC, PINC
+#define PORTC0 0
+#define PORTC1 1
+#define PORTC2 2
+#define DDC0 0
+#define DDC1 1
+#define DDC2 2
+#define PINC2 2
+// PORTD, DDRD, PIND
+#define PORTD2 2
+#define DDD2 2
+#define PIND2 2
+// EICRA, EIMSK, EIFR
+#define ISC01 1
+#define ISC00 0
+#define INT0 0
+#define INTF0 0
+
+#endif /* HOST_AVR_IO_H_ */
@@ -0,0 +1,13 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef HOST_AVR_PGMSPACE_H_
+#define HOST_AVR_PGMSPACE_H_
+
+#include <stdio.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define printf_P printf
+
+#endif /* HOST_AVR_PGMSPACE_H_ */
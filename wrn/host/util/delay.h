@@ -0,0 +1,11 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef HOST_UTIL_DELAY_H_
+#define HOST_UTIL_DELAY_H_
+
+// the host does not wait for the hardware
+#define _delay_ms(ms)
+#define _delay_us(us)
+
+#endif /* HOST_UTIL_DELAY_H_ */
@@ -3,7 +3,6 @@
 
 #define DEBUG_CMD_DELAY 1000
 #define RF24_CHANEL 62 // uint8_t
-#define WDT_BITS_PER_CYCLE 16
 
 
 #include <avr/io.h>
@@ -22,6 +21,7 @@
 #include <RF24Network.h>
 #include <RF24.h>
 #include "EepromLog.h"
+#include "Scheduler.h"
 #include "main.h"
 
 SerialCommand cmd(&sys_serial);
@@ -49,10 +49,95 @@ void blink_once(void)
 	PORTC &= ~_BV(PORTC0);
 }
 
-int main(void)
+// CMD_NRF_FORWARD
+static bool task_nrf(void)
+{
+	if (nrf_device.read(&cmd)) {
+		if (!nrf_device.run(&cmd)) cmd.send_header(-1);
+		//cmd.reset();
+	}
+	return false;
+}
+
+// CMD_RNG_SEND; one of the samples which came from the ADC interrupt, the payload goes out as it grows
+static bool task_rng(void)
+{
+	if (rng_device.available() > 0 && rng_device.read(&cmd)) {
+		if (!rng_device.run(&cmd)) cmd.send_header(-1);
+		//cmd.reset();
+	}
+	rng_device.drain(&cmd);
+	return rng_device.available() > 0;
+}
+
+static bool task_wdt(void)
+{
+	// watchdog trigger
+	wdt_device.update();
+
+	// the next page of the WDT log
+	if (wdt_device.read(&cmd)) {
+		if (!wdt_device.run(&cmd)) cmd.send_header(-1);
+	}
+
+	// the log clean is done in the background
+	if (sys_log.update()) {
+		common_device.confirm_clean(&cmd);
+	}
+	return false;
+}
+
+// serial commands; more of them may be waiting in the RX buffer
+static bool task_cmd(void)
 {
 	bool cmd_ok = false;
 
+#ifdef DEBUG
+	static int m = DEBUG_CMD_DELAY;  // rounds
+	if (--m <= 0) {
+		m = DEBUG_CMD_DELAY;
+		//cmd.set(CMD_COMMON, 1, 1460792071, 0); // look to the SerialCommand::read
+		//sys_log.write(sys_time.now(), LOG_BOOT);
+	}
+	//_delay_ms(1);
+#endif
+
+	if (cmd.read()) {
+#ifdef DEBUG
+		blink_once();
+#endif
+		switch (cmd.get_type()) {
+			case CMD_COMMON:
+				cmd_ok = common_device.run(&cmd);
+				break;
+			case CMD_WDT:
+				cmd_ok = wdt_device.run(&cmd);
+				break;
+			case CMD_RNG:
+				cmd_ok = rng_device.run(&cmd);
+				break;
+			case CMD_NRF:
+				cmd_ok = nrf_device.run(&cmd);
+				break;
+			default:
+				break;
+		}
+		if (!cmd_ok) cmd.send_header(-1);
+		//cmd.reset();
+	}
+	return sys_serial.available() > 0;
+}
+
+// in the order of SchedulerTask; the budgets can be changed by C7
+Task tasks[TASK_NUM] = {
+	{task_nrf, 0, false},
+	{task_rng, SCHED_RNG_BUDGET, true},
+	{task_wdt, 0, false},
+	{task_cmd, 0, false}
+};
+
+int main(void)
+{
 	wdt_enable(WDTO_8S);
 
 	// ADC enable; prescaler: 128 (156 KHz @ 20MHz)
@@ -64,7 +149,6 @@ int main(void)
 	PORTC &= ~_BV(PORTC2);  // LOW
 
 #ifdef DEBUG
-	int m = DEBUG_CMD_DELAY;  // ms
 	fdevopen(&serial_putc, 0);  // open the stdout and stderr streams
 #endif
 
@@ -78,68 +162,21 @@ int main(void)
 	common_device.confirm_boot(&cmd);
 	//cmd.reset();  // look to the SerialCommand::read
 
-	sys_log.begin();
+	sys_log.begin();  // a log it cannot read is erased, the new one starts empty
+	rng_device.begin();
 	SPI.begin();
 	if (radio.begin()) {
 		 network.begin(RF24_CHANEL, rx_node);
 		 nrf_device.setup(&network);
 	}
 
+	sys_scheduler.begin(tasks);
 	while(true)
 	{
+		PROFILE(PROFILE_LOOP);
 		wdt_reset();
-
-		// CMD_NRF_FORWARD
-		if (nrf_device.read(&cmd)) {
-			if (!nrf_device.run(&cmd)) cmd.send_header(-1);
-			//cmd.reset();
-		}
-
-		// CMD_RNG_SEND
-		for (int i = 0; i < WDT_BITS_PER_CYCLE; i++) {
-			if (rng_device.read(&cmd)) {
-				if (!rng_device.run(&cmd)) cmd.send_header(-1);
-				//cmd.reset();
-			}
-		}
-
-		// watchdog trigger
-		wdt_device.update();
-
-#ifdef DEBUG
-		if (--m <= 0) {
-			m = DEBUG_CMD_DELAY;
-			//cmd.set(CMD_COMMON, 1, 1460792071, 0); // look to the SerialCommand::read
-			//sys_log.write(sys_time.now(), LOG_BOOT);
-		}
-		//_delay_ms(1);
-#endif
-
-		// serial commands
-		if (cmd.read()) {
-#ifdef DEBUG
-			blink_once();
-#endif
-			cmd_ok = false;
-			switch (cmd.get_type()) {
-				case CMD_COMMON:
-					cmd_ok = common_device.run(&cmd);
-					break;
-				case CMD_WDT:
-					cmd_ok = wdt_device.run(&cmd);
-					break;
-				case CMD_RNG:
-					cmd_ok = rng_device.run(&cmd);
-					break;
-				case CMD_NRF:
-					cmd_ok = nrf_device.run(&cmd);
-					break;
-				default:
-					break;
-			}
-			if (!cmd_ok) cmd.send_header(-1);
-			//cmd.reset();
-		}
+		cmd.transmit();  // the queued frames go before the next RNG frame
+		sys_scheduler.run();
 	} // while(true)
 
 	sys_serial.end();
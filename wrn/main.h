@@ -10,4 +10,20 @@
 #define IF_DEBUG(x)
 #endif
 
+// The sections of the main loop for the cycle accounting of the simulator (wrn/sim).
+// A marker is one OUT to GPIOR0, the code of the ISRs is counted in the current section.
+enum ProfileSection {
+	PROFILE_LOOP = 1,  // the iteration starts
+	PROFILE_NRF,
+	PROFILE_RNG,
+	PROFILE_WDT,
+	PROFILE_CMD
+};
+
+#ifdef SIM_PROFILE
+#define PROFILE(x) (GPIOR0 = (x))
+#else
+#define PROFILE(x)
+#endif
+
 #endif /* MAIN_H_ */
@@ -0,0 +1,438 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// Runs the wrn firmware in simavr: the USART is bridged to a pty for wrnd, the ADC5
+// input is replayed from a noise file, the cycles of the main loop sections are
+// counted by the PROFILE markers (main.h) and the RNG payloads by the frames sent.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <pty.h>
+#include <time.h>
+#include <termios.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_adc.h>
+#include "../main.h"
+#include "../../wrnd/devices.h"
+
+#define SIM_VERSION "0.1"
+#define SIM_MCU "atmega328p"
+#define SIM_FREQUENCY 20000000
+#define SIM_VCC 5000  // mV, AVCC is the reference of the ADC
+#define SIM_GPIOR0 0x3E  // data address of the PROFILE markers
+#define SIM_POLL_CYCLES 10000  // 0.5 ms, the pty and the wall clock are checked
+#define SIM_REPORT_CYCLES SIM_FREQUENCY  // a report per simulated second
+#define SIM_RX_BUFFER_SIZE 256
+#define SIM_NOISE_MEAN 512  // without a noise file
+#define SIM_DEFAULT_FIRMWARE "wrn.elf"
+
+#define E_SYSERROR 1
+#define E_OPTERROR 3
+
+enum { SECTION_NONE = 0, SECTION_COUNT = PROFILE_CMD + 1 };
+
+static const char *section_names[SECTION_COUNT] = {"", "LOOP", "NRF", "RNG", "WDT", "CMD"};
+
+static avr_t *avr = NULL;
+static volatile sig_atomic_t terminated = 0;
+static bool realtime = true;
+static int pty_master = -1;
+
+static uint16_t *noise = NULL;
+static size_t noise_len = 0, noise_pos = 0;
+
+static const char *boot_commands = NULL;  // sent when the main loop has started
+static unsigned char rx_buffer[SIM_RX_BUFFER_SIZE];
+static size_t rx_len = 0;
+static bool rx_xon = true;
+
+// the last report period and the whole run
+struct stats {
+	avr_cycle_count_t cycles[SECTION_COUNT];
+	avr_cycle_count_t loop_max;
+	unsigned long loops;
+	unsigned long rng_bytes;
+};
+
+static struct stats period, total;
+static uint8_t section = SECTION_NONE;
+static avr_cycle_count_t section_start = 0, loop_start = 0, period_start = 0;
+
+static unsigned char frame_header[sizeof(struct payload_header)];
+static size_t frame_len = 0, frame_skip = 0;
+
+static struct timespec wall_start;
+
+static void usage(char *progname)
+{
+	fprintf(stderr, "%s version %s, usage:\n", progname, SIM_VERSION);
+	fprintf(stderr, "%s [options]\n", progname);
+	fprintf(stderr, "Options (default value in parenthesis):\n");
+	fprintf(stderr, "  -h, --help                  Print this help message\n");
+	fprintf(stderr, "  -f, --firmware=file         ELF of the firmware built with SIM_PROFILE (%s)\n", SIM_DEFAULT_FIRMWARE);
+	fprintf(stderr, "  -N, --noise=file            ADC samples, uint16 LE as written by wrnd --raw-capture (random)\n");
+	fprintf(stderr, "  -p, --pty-link=file         Symlink to the pty of the USART for wrnd --device-port\n");
+	fprintf(stderr, "  -c, --commands=list         Commands sent after the boot, separated by ';' (e.g. R0)\n");
+	fprintf(stderr, "  -t, --time=sec              Simulated time to run (0 - until interrupted)\n");
+	fprintf(stderr, "  -F, --fast                  Do not slow down to the real time\n");
+	exit(E_OPTERROR);
+}
+
+static void signal_handler(int sig)
+{
+	terminated = 1;
+}
+
+static bool load_noise(const char *path)
+{
+	FILE *f;
+	long size;
+	size_t n = 0;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot open the noise file %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+
+	noise = malloc(size > 0 ? size : 1);
+	if (noise == NULL || size < 2 || fread(noise, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "Cannot read the noise file %s.\n", path);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+
+	// the gaps of the capture are dropped, the samples are contiguous for the ADC
+	for (size_t i = 0; i < size / sizeof(uint16_t); i++) {
+		if (noise[i] != RNG_RAW_GAP)
+			noise[n++] = noise[i] & 0x3FF;
+	}
+	noise_len = n;
+	if (noise_len == 0) {
+		fprintf(stderr, "The noise file %s has no samples.\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+// the noise file is looped, without it the sum of 12 uniform values is near normal
+static uint16_t next_sample()
+{
+	int v = 0;
+
+	if (noise_len > 0) {
+		uint16_t sample = noise[noise_pos++];
+		if (noise_pos == noise_len)
+			noise_pos = 0;
+		return sample;
+	}
+
+	for (int i = 0; i < 12; i++)
+		v += rand() & 0x0F;
+	return SIM_NOISE_MEAN + v - 12 * 15 / 2;
+}
+
+// a conversion starts, the sample of it is set on the input
+static void adc_trigger(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	uint32_t mv = (uint32_t)next_sample() * SIM_VCC / 1024;
+
+	avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC5), mv);
+}
+
+static void profile_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	avr_cycle_count_t now = avr->cycle;
+
+	avr->data[addr] = v;
+	if (section != SECTION_NONE)
+		period.cycles[section] += now - section_start;
+	section = v < SECTION_COUNT ? v : SECTION_NONE;
+	section_start = now;
+
+	if (v == PROFILE_LOOP) {
+		if (loop_start != 0 && period.loop_max < now - loop_start)
+			period.loop_max = now - loop_start;
+		loop_start = now;
+		period.loops++;
+	}
+}
+
+// the frames are followed as wrnd does it, the sync sequence and the noise are skipped
+static void count_frame(unsigned char c)
+{
+	struct payload_header *header = (struct payload_header *)frame_header;
+
+	if (frame_skip > 0) {
+		frame_skip--;
+		return;
+	}
+
+	frame_header[frame_len++] = c;
+	if (frame_len < sizeof(frame_header))
+		return;
+
+	if (header->type_id >= CMD_UNKNOWN || header->payload_size < -1) {
+		memmove(frame_header, frame_header + 1, --frame_len);
+		return;
+	}
+
+	frame_len = 0;
+	if (header->payload_size > 0)
+		frame_skip = header->payload_size;
+	if (header->type_id == CMD_RNG_SEND && header->cmd_id == RNG_SEND_PAYLOAD && header->payload_size > 0)
+		period.rng_bytes += header->payload_size;
+}
+
+static void uart_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	unsigned char c = value;
+
+	count_frame(c);
+	if (pty_master != -1 && write(pty_master, &c, 1) != 1 && errno != EAGAIN)
+		fprintf(stderr, "Cannot write to the pty: %s\n", strerror(errno));
+}
+
+static void uart_xon(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	rx_xon = true;
+}
+
+static void uart_xoff(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	rx_xon = false;
+}
+
+static void uart_input()
+{
+	avr_irq_t *input = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	ssize_t n;
+	size_t i = 0;
+
+	if (boot_commands != NULL && period.loops + total.loops > 0) {
+		for (const char *c = boot_commands; *c && rx_len < sizeof(rx_buffer) - 1; c++)
+			rx_buffer[rx_len++] = (*c == ';') ? '\n' : *c;
+		rx_buffer[rx_len++] = '\n';
+		boot_commands = NULL;
+	}
+	if (pty_master != -1 && rx_len < sizeof(rx_buffer)) {
+		n = read(pty_master, rx_buffer + rx_len, sizeof(rx_buffer) - rx_len);
+		if (n > 0)
+			rx_len += n;
+	}
+
+	while (i < rx_len && rx_xon)
+		avr_raise_irq(input, rx_buffer[i++]);
+	memmove(rx_buffer, rx_buffer + i, rx_len - i);
+	rx_len -= i;
+}
+
+static void add_stats(struct stats *to, struct stats *from)
+{
+	for (int i = 0; i < SECTION_COUNT; i++)
+		to->cycles[i] += from->cycles[i];
+	if (to->loop_max < from->loop_max)
+		to->loop_max = from->loop_max;
+	to->loops += from->loops;
+	to->rng_bytes += from->rng_bytes;
+}
+
+static void print_stats(const char *title, struct stats *s, avr_cycle_count_t cycles)
+{
+	double sec = (double)cycles / SIM_FREQUENCY;
+
+	printf("%-8s %lu loops; cycles per loop %.0f, max %llu;", title, s->loops,
+		s->loops ? (double)cycles / s->loops : 0, (unsigned long long)s->loop_max);
+	for (int i = PROFILE_LOOP; i < SECTION_COUNT; i++)
+		printf(" %s %.0f", section_names[i], s->loops ? (double)s->cycles[i] / s->loops : 0);
+	printf("; RNG %.0f B/s\n", sec > 0 ? s->rng_bytes / sec : 0);
+	fflush(stdout);
+}
+
+// the simulation is not faster than the board, wrnd sees the real rates
+static void pace()
+{
+	struct timespec now, delay;
+	double ahead;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ahead = (double)avr->cycle / SIM_FREQUENCY - (now.tv_sec - wall_start.tv_sec)
+		- (now.tv_nsec - wall_start.tv_nsec) / 1e9;
+	if (ahead <= 0)
+		return;
+	delay.tv_sec = (time_t)ahead;
+	delay.tv_nsec = (long)((ahead - delay.tv_sec) * 1e9);
+	nanosleep(&delay, NULL);
+}
+
+static avr_cycle_count_t poll_timer(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	char title[32];
+
+	uart_input();
+	if (realtime)
+		pace();
+
+	if (avr->cycle - period_start >= SIM_REPORT_CYCLES) {
+		snprintf(title, sizeof(title), "%.0f s", (double)avr->cycle / SIM_FREQUENCY);
+		print_stats(title, &period, avr->cycle - period_start);
+		add_stats(&total, &period);
+		memset(&period, 0, sizeof(period));
+		period_start = avr->cycle;
+	}
+
+	return when + SIM_POLL_CYCLES;
+}
+
+static bool open_pty(const char *link)
+{
+	int slave;
+	char name[64];
+	struct termios tio;
+
+	if (openpty(&pty_master, &slave, name, NULL, NULL) == -1) {
+		fprintf(stderr, "Cannot open a pty: %s\n", strerror(errno));
+		return false;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	close(slave);  // wrnd opens it by the name
+	fcntl(pty_master, F_SETFL, fcntl(pty_master, F_GETFL) | O_NONBLOCK);
+
+	unlink(link);
+	if (symlink(name, link) == -1) {
+		fprintf(stderr, "Cannot link %s to %s: %s\n", link, name, strerror(errno));
+		return false;
+	}
+	printf("USART is on %s (%s)\n", name, link);
+
+	return true;
+}
+
+int main(int argc, char *const argv[])
+{
+	int opt = 0, state;
+	char *progname = basename(argv[0]);
+	char *opts = "hf:N:p:c:t:F";
+	const char *firmware_path = SIM_DEFAULT_FIRMWARE, *pty_link = NULL;
+	unsigned long sim_time = 0;
+	uint32_t flags = 0;
+	elf_firmware_t firmware;
+	struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"firmware", required_argument, NULL, 'f'},
+		{"noise", required_argument, NULL, 'N'},
+		{"pty-link", required_argument, NULL, 'p'},
+		{"commands", required_argument, NULL, 'c'},
+		{"time", required_argument, NULL, 't'},
+		{"fast", no_argument, NULL, 'F'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, opts, long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'f':
+			if (optarg != NULL && strlen(optarg) > 0)
+				firmware_path = optarg;
+			break;
+		case 'N':
+			if (optarg != NULL && strlen(optarg) > 0 && !load_noise(optarg))
+				return E_OPTERROR;
+			break;
+		case 'p':
+			if (optarg != NULL && strlen(optarg) > 0)
+				pty_link = optarg;
+			break;
+		case 'c':
+			if (optarg != NULL && strlen(optarg) > 0)
+				boot_commands = optarg;
+			break;
+		case 't':
+			if (optarg != NULL && strlen(optarg) > 0)
+				sim_time = strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			realtime = false;
+			break;
+		case 'h':
+		default:
+			usage(progname);
+		}
+	}
+
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(firmware_path, &firmware) != 0) {
+		fprintf(stderr, "Cannot load the firmware %s.\n", firmware_path);
+		return E_SYSERROR;
+	}
+	if (firmware.mmcu[0] == '\0')
+		strcpy(firmware.mmcu, SIM_MCU);
+	if (firmware.frequency == 0)
+		firmware.frequency = SIM_FREQUENCY;
+
+	avr = avr_make_mcu_by_name(firmware.mmcu);
+	if (avr == NULL) {
+		fprintf(stderr, "simavr has no %s core.\n", firmware.mmcu);
+		return E_SYSERROR;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	avr->vcc = avr->avcc = avr->aref = SIM_VCC;
+
+	// the bytes go to the pty only, not to the stdout of simavr
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uart_output, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), uart_xon, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), uart_xoff, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_OUT_TRIGGER), adc_trigger, NULL);
+	avr_register_io_write(avr, SIM_GPIOR0, profile_write, NULL);
+
+	if (pty_link != NULL && !open_pty(pty_link))
+		return E_SYSERROR;
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	avr_cycle_timer_register(avr, SIM_POLL_CYCLES, poll_timer, NULL);
+
+	while (!terminated) {
+		state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed) {
+			fprintf(stderr, "The firmware has stopped (%d) at %.3f s.\n", state, (double)avr->cycle / SIM_FREQUENCY);
+			break;
+		}
+		if (sim_time > 0 && avr->cycle >= (avr_cycle_count_t)sim_time * SIM_FREQUENCY)
+			break;
+	}
+
+	add_stats(&total, &period);
+	print_stats("total", &total, avr->cycle);
+
+	if (pty_link != NULL)
+		unlink(pty_link);
+	free(noise);
+	return 0;
+}
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <math.h>
+#include <endian.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,30 +13,53 @@
 #include <time.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "devices.h"
 #include "utils.h"
+#include "sink.h"
 #include "wrnd.h"
 
-static int cmd_fifo_fd = -1, rng_fifo_fd = -1, nrf_fifo_fd = -1, wdt_fifo_fd = -1;
-static char message_buffer[COMMAND_FEEDBACK_SIZE];
-static char time_buffer[21];
+static int wdt_fifo_fd = -1;
+// the dispatchers are called by the CMD and NRF workers
+static __thread char message_buffer[COMMAND_FEEDBACK_SIZE];
+static __thread char time_buffer[21];
 
 static pthread_spinlock_t wrn_wdt_lock;
 static pthread_t wrn_wdt_thread;
 static struct timeval wrn_wdt_keep_alive_sent = {.tv_sec = 0, .tv_usec = 0};
 static bool wrn_wdt_ok_to_close = false;
 
+static pthread_mutex_t device_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cmd_client_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cmd_client_done = PTHREAD_COND_INITIALIZER;
+static pthread_t wrn_cmd_thread;
+static int cmd_socket_fd = -1, cmd_client_fd = -1;
+static int raw_capture_fd = -1;
+static unsigned long long raw_samples = 0, raw_dropped = 0;
+// the W4 transfer, under cmd_client_lock: the index of the next page (-1 - any page starts
+// the transfer), the slot of its record 0 (-1 - any) and n of the request
+static int log_page_next = -1;
+static int log_page_first = -1;
+static unsigned long log_page_limit = 0;
+static bool log_page_resumed = false;
+static unsigned long cmd_client_progress = 0;  // the pages accepted, each one extends the wait
+
 
 static const char **command_list[] = {
-	(const char *[]){"COMMON", "SYNC", "TIME", "STATUS", "RESET", "PROGRAM", "LOG-CLEAN", "UNKNOWN", NULL},
+	(const char *[]){"COMMON", "SYNC", "TIME", "STATUS", "RESET", "PROGRAM", "LOG-CLEAN", "SCHEDULER", "BUDGET", "UNKNOWN", NULL},
 	(const char *[]){"WDT", "KEEP-ALIVE", "DEACTIVATE", "STATUS", "TIMEOUT", "LOG", "UNKNOWN", NULL},
-	(const char *[]){"RNG", "FLOOD-ON", "FLOOD-OFF", "STATUS", "UNKNOWN", NULL},
-	(const char *[]){"RNG-SEND", "PAYLOAD", "UNKNOWN", NULL},
+	(const char *[]){"RNG", "FLOOD-ON", "FLOOD-OFF", "STATUS", "EXTRACTOR", "SAMPLE-BITS", "HISTOGRAM", "RAW", "CONDITIONER", "PAYLOAD", "UNKNOWN", NULL},
+	(const char *[]){"RNG-SEND", "PAYLOAD", "RAW", "HEALTH", "UNKNOWN", NULL},
 	(const char *[]){"NRF", "UNKNOWN", NULL},
 	(const char *[]){"NRF-FORWARD", "L", "UNKNOWN", NULL}
 };
 static const char *log_event_list[] = {"EMPTY", "BOOT", "RESET"};
+static const char *rng_extractor_list[] = {"LEGACY", "VON-NEUMANN", "PERES", "UNKNOWN"};
+static const char *sched_task_list[] = {"NRF", "RNG", "WDT", "CMD"};
 
 
 static const char *get_device_name(struct payload_header *header)
@@ -66,6 +91,37 @@ static const char *get_command_name(struct payload_header *header)
 	return NULL;
 }
 
+// a header found in a byte stream, the real one is confirmed by the next header
+bool device_header_plausible(struct payload_header *header)
+{
+	if (header->payload_size == -1)  // the device refuses any command it does not know
+		return get_device_name(header) != NULL;
+
+	if (get_command_name(header) == NULL || header->payload_size < 0 || header->payload_size > SERIAL_RX_BUFFER_SIZE)
+		return false;
+
+	// the most frequent frames, their sizes are known
+	if ((enum command_type)header->type_id == CMD_RNG_SEND) {
+		switch ((enum rng_send_command)header->cmd_id) {
+			case RNG_SEND_PAYLOAD:
+				return header->payload_size >= RNG_PAYLOAD_MIN && header->payload_size <= RNG_PAYLOAD_MAX;
+			case RNG_SEND_RAW:
+				return header->payload_size == RNG_RAW_PAYLOAD_SIZE;
+			default:
+				return false;
+		}
+	}
+
+	// a page of the log or the confirmation of the empty one
+	if ((enum command_type)header->type_id == CMD_WDT && (enum wdt_command)header->cmd_id == WDT_LOG) {
+		size_t records = header->payload_size - sizeof(struct wdt_log_page);
+		return header->payload_size == 0 || (header->payload_size > (int16_t)sizeof(struct wdt_log_page)
+			&& records % sizeof(struct log_record) == 0 && records / sizeof(struct log_record) <= WDT_LOG_PAGE);
+	}
+
+	return true;
+}
+
 void log_device_error(struct payload_header *header)
 {
 	const char *dev_name, *cmd_name;
@@ -179,8 +235,11 @@ bool device_write_command(const char *cmd, const char *name)
 		return false;
 
 	len = strlen(cmd);
+	// the main, WDT and command threads share the port
+	pthread_mutex_lock(&device_write_lock);
 	n = write(serial_fd, cmd, len);
 	n += write(serial_fd, "\n", 1);
+	pthread_mutex_unlock(&device_write_lock);
 
 	len++;
 	if (n != len) {
@@ -210,6 +269,24 @@ static bool device_update_time()
 	return true;
 }
 
+// the payload carries the RNG bytes of the latency goal, 0 - the largest payload for the throughput
+static bool device_set_rng_payload()
+{
+	char cmd[COMMAND_MAX_SIZE];
+	unsigned long size = RNG_PAYLOAD_MAX;
+
+	if (arguments->rng_latency > 0) {
+		size = (unsigned long)RNG_NOMINAL_RATE * arguments->rng_latency / 1000;
+		if (size < RNG_PAYLOAD_MIN)
+			size = RNG_PAYLOAD_MIN;
+		if (size > RNG_PAYLOAD_MAX)
+			size = RNG_PAYLOAD_MAX;
+	}
+	snprintf(cmd, sizeof(cmd), "R8:%lu", size);
+
+	return device_write_command(cmd, "RNG:PAYLOAD");
+}
+
 static bool device_set_wdt_timeout()
 {
 	char *cmd = malloc(snprintf(NULL, 0, "W3:%u", arguments->wdt_timeout) + 1);
@@ -270,12 +347,76 @@ bool init_device()
 	if (!device_set_wdt_timeout())
 		return false;
 
+	if (!device_set_rng_payload())
+		return false;
+
 	if (!device_write_command("R0", "RNG:FLOOD-ON"))
 		return false;
 
+	if (raw_capture_fd != -1 && !device_write_command("R6:1", "RNG:RAW"))
+		return false;
+
+	return true;
+}
+
+// the samples are appended as 16 bit little-endian words
+bool open_raw_capture()
+{
+	if (arguments->raw_file == NULL)
+		return true;
+
+	raw_capture_fd = open(arguments->raw_file, O_WRONLY | O_CREAT | O_APPEND, 0640);
+	if (raw_capture_fd == -1) {
+		log_message(WRND_ERROR, "Cannot open the raw capture file %s: %s", arguments->raw_file, strerror(errno));
+		return false;
+	}
+
 	return true;
 }
 
+static void close_raw_capture()
+{
+	if (raw_capture_fd == -1)
+		return;
+
+	device_write_command("R6:0", "RNG:RAW");
+	close(raw_capture_fd); raw_capture_fd = -1;
+	log_message(WRND_RNG, "Raw capture: %llu samples; %llu dropped by the device", raw_samples, raw_dropped);
+}
+
+// 4 samples in 5 bytes: bits 9..2 of every sample, then bits 1..0 of all 4 from the lowest
+static void write_raw_capture(struct payload_header *header, const unsigned char *payload)
+{
+	uint16_t samples[SERIAL_RX_BUFFER_SIZE / 5 * 4 + 1];
+	uint16_t dropped;
+	size_t n = 0, len;
+	ssize_t written;
+
+	if (raw_capture_fd == -1 || header->payload_size < (int16_t)sizeof(dropped))
+		return;
+
+	memcpy(&dropped, payload, sizeof(dropped));
+	dropped = le16toh(dropped);
+	if (dropped > 0) {
+		samples[n++] = htole16(RNG_RAW_GAP);
+		raw_dropped += dropped;
+	}
+	for (int g = sizeof(dropped); g + 5 <= header->payload_size; g += 5) {
+		for (int k = 0; k < 4; k++)
+			samples[n++] = htole16((payload[g + k] << 2) | ((payload[g + 4] >> (2 * k)) & 0x03));
+		raw_samples += 4;
+	}
+
+	len = n * sizeof(*samples);
+	for (size_t off = 0; off < len; off += written) {
+		written = write(raw_capture_fd, (const char *)samples + off, len - off);
+		if (written <= 0) {
+			log_message(WRND_ERROR, "Cannot write the raw capture file: %s", strerror(errno));
+			return;
+		}
+	}
+}
+
 bool init_fifos()
 {
 	if (!create_fifo(arguments->rng_fifo, 0640))
@@ -295,11 +436,18 @@ bool init_fifos()
 
 void close_device()
 {
+	close_raw_capture();
 	device_write_command("R1", "RNG:FLOOD-OFF");
-	close(rng_fifo_fd); rng_fifo_fd = -1;
-	close(nrf_fifo_fd); nrf_fifo_fd = -1;
 	close(wdt_fifo_fd); wdt_fifo_fd = -1;
-	close(cmd_fifo_fd); cmd_fifo_fd = -1;
+}
+
+// RNG payloads are queued in batches, the sink writes them with one writev or one linked io_uring chain
+bool write_rng_fifo(const struct iovec *iov, int iovcnt)
+{
+	if (iov == NULL || iovcnt <= 0)
+		return false;
+
+	return sink_write(FIFO_RNG, iov, iovcnt, false);
 }
 
 bool write_fifo(enum destination_fifo dest, const char *msg, size_t count)
@@ -307,45 +455,70 @@ bool write_fifo(enum destination_fifo dest, const char *msg, size_t count)
 	return write_fifo_and_close(dest, msg, count, false);
 }
 
-bool write_fifo_and_close(enum destination_fifo dest, const char *msg, size_t count, bool close_fifo)
+static bool write_cmd_client(const char *msg, size_t count, bool close_client)
 {
-	int *fd;
-	char *fifo;
+	ssize_t n;
 
-	if (msg == NULL || count <= 0)
+	pthread_mutex_lock(&cmd_client_lock);
+	if (cmd_client_fd == -1) {
+		pthread_mutex_unlock(&cmd_client_lock);
 		return false;
+	}
 
-	switch(dest) {
-		case FIFO_CMD:
-			fd = &cmd_fifo_fd;
-			fifo = COMMAND_FIFO;
-			break;
-		case FIFO_RNG:
-			fd = &rng_fifo_fd;
-			fifo = arguments->rng_fifo;
-			break;
-		case FIFO_NRF:
-			fd = &nrf_fifo_fd;
-			fifo = arguments->nrf_fifo;
-			break;
-		default:
-			fd = NULL;
-			break;
+	while (count > 0) {
+		n = send(cmd_client_fd, msg, count, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;  // the client has gone, the response is dropped
+		msg += n;
+		count -= n;
 	}
-	if (fd == NULL)
+	if (close_client) {
+		close(cmd_client_fd); cmd_client_fd = -1;
+		pthread_cond_broadcast(&cmd_client_done);
+	}
+	pthread_mutex_unlock(&cmd_client_lock);
+
+	return true;
+}
+
+static void close_cmd_fifo()
+{
+	if (write_cmd_client("", 0, true))
+		return;
+
+	sink_write(FIFO_CMD, NULL, 0, true);
+}
+
+bool write_fifo_and_close(enum destination_fifo dest, const char *msg, size_t count, bool close_fifo)
+{
+	if (msg == NULL || count <= 0)
 		return false;
 
-	if (*fd == -1)
-		// open return -1 if no process open file for reading
-		*fd = open(fifo, O_WRONLY | O_NDELAY);
-	if (*fd != -1) {
-		// ignore the result
-		write(*fd, msg, count);
-		if (close_fifo) {  // unblock the reader thread
-			close(*fd); *fd = -1;
-		}
+	// responses go to the wrnctrl client if there is one waiting
+	if (dest == FIFO_CMD && write_cmd_client(msg, count, close_fifo))
+		return true;
+
+	// the sink of the FIFO writes the message when its reader is ready
+	return sink_write(dest, &(struct iovec){.iov_base = (void *)msg, .iov_len = count}, 1, close_fifo);
+}
+
+// the share of a task is of the time of all the tasks, the main loop itself is not measured
+static void format_scheduler_stats(struct payload_header *header, struct scheduler_stats *p)
+{
+	uint64_t total = 0;
+	size_t len;
+
+	for (int i = 0; i < SCHED_TASKS; i++)
+		total += p->tasks[i].ticks;
+	len = snprintf(message_buffer, sizeof(message_buffer), "SCHEDULER [%" PRIu16 "] Rounds: %" PRIu32 "\n",
+		header->seq_num, p->rounds);
+	for (int i = 0; i < SCHED_TASKS && len < sizeof(message_buffer); i++) {
+		struct scheduler_task_stats *t = &p->tasks[i];
+		len += snprintf(message_buffer + len, sizeof(message_buffer) - len,
+			"%s: Budget: %" PRIu16 " (%lu cycles); Runs: %" PRIu32 "; Cut: %" PRIu16 "; Max: %lu cycles; Load: %.1f%%\n",
+			sched_task_list[i], t->budget, (unsigned long)t->budget * SCHED_TIMER1_CYCLES, t->runs, t->cuts,
+			(unsigned long)t->max_ticks * SCHED_TIMER1_CYCLES, total ? 100.0 * t->ticks / total : 0.0);
 	}
-	return true;
 }
 
 static void dispatch_common_payload(struct payload_header *header, const unsigned char *payload)
@@ -361,9 +534,10 @@ static void dispatch_common_payload(struct payload_header *header, const unsigne
 		case COMMON_STATUS: {
 			struct common_status *p = (struct common_status *)payload;
 			time_t t = p->time;
-			struct tm *time = localtime(&t);
+			struct tm time;
+			localtime_r(&t, &time);
 			int updays = p->uptime / 60 / 60 / 24;
-			strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", time);
+			strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", &time);
 			snprintf(message_buffer, sizeof(message_buffer),
 				"SYSTEM [%" PRIu16 "] %s; Uptime: %d %s %02d:%02d:%02d; Vcc: %.02f; Lock: %s\n",
 				header->seq_num, time_buffer, updays, (updays > 1 ? "days" : "day"),
@@ -377,6 +551,11 @@ static void dispatch_common_payload(struct payload_header *header, const unsigne
 			break;
 		case COMMON_LOG_CLEAN:
 			break;
+		case COMMON_SCHEDULER:
+			format_scheduler_stats(header, (struct scheduler_stats *)payload);
+			break;
+		case COMMON_BUDGET:
+			break;
 		case COMMON_UNKNOWN:
 		default:
 			break;
@@ -386,6 +565,59 @@ static void dispatch_common_payload(struct payload_header *header, const unsigne
 	write_fifo_and_close(FIFO_CMD, message_buffer, strlen(message_buffer), true);
 }
 
+// The pages of W4 come in order. After a lost one the rest is asked for again
+// from its index, the pages which are already on the way are dropped. A page of
+// another record 0 means the log has changed, the transfer starts again.
+static bool accept_log_page(struct wdt_log_page *page)
+{
+	char cmd[COMMAND_MAX_SIZE];
+	bool accept = false, changed = false;
+	int from = -1;
+
+	pthread_mutex_lock(&cmd_client_lock);
+	if (page->index == 0 && page->first != log_page_first) {
+		accept = true;  // the device has started it again
+		changed = log_page_next > 0;
+	} else if (log_page_next == -1 || (page->index == log_page_next && page->first == log_page_first)) {
+		accept = true;
+	} else if (page->first != log_page_first && (page->index == log_page_next || !log_page_resumed)) {
+		changed = true;
+		from = 0;
+		log_page_next = 0;
+		log_page_first = -1;
+	} else if (page->index > log_page_next && !log_page_resumed) {
+		from = log_page_next;
+	}
+
+	if (accept) {
+		log_page_first = page->first;
+		log_page_resumed = false;
+		cmd_client_progress++;
+		pthread_cond_broadcast(&cmd_client_done);
+	}
+	if (from != -1)
+		snprintf(cmd, sizeof(cmd), "W4:%lu:%d", log_page_limit, from);
+	pthread_mutex_unlock(&cmd_client_lock);
+
+	if (changed) {
+		log_message(WRND_WDT, "WDT: The log has changed, restarting the transfer");
+		snprintf(message_buffer, sizeof(message_buffer), "The device log has changed, the transfer is restarted.\n");
+		write_fifo(FIFO_CMD, message_buffer, strlen(message_buffer));
+	} else if (from != -1) {
+		log_message(WRND_WDT, "WDT: Log page %d is lost, resuming", from);
+	}
+
+	if (from != -1) {
+		bool resumed = device_write_command(cmd, "WDT:LOG");
+
+		pthread_mutex_lock(&cmd_client_lock);
+		log_page_resumed = resumed;
+		pthread_mutex_unlock(&cmd_client_lock);
+	}
+
+	return accept;
+}
+
 static void dispatch_wdt_payload(struct payload_header *header, const unsigned char *payload)
 {
 	if ((enum command_type)header->type_id != CMD_WDT)
@@ -408,22 +640,36 @@ static void dispatch_wdt_payload(struct payload_header *header, const unsigned c
 		case WDT_TIMEOUT:
 			break;
 		case WDT_LOG: {
+			struct wdt_log_page *page = (struct wdt_log_page *)payload;
 			struct log_record *p;
 			time_t t;
-			struct tm *time;
+			struct tm time;
 			size_t event_list_len = sizeof(log_event_list) / sizeof(*log_event_list);
+			int16_t count = (header->payload_size - sizeof(*page)) / sizeof(struct log_record);
+			bool done;
 
-			for (int16_t i = 0; i < header->payload_size; i += sizeof(struct log_record)) {
+			if (!accept_log_page(page))
+				break;
+
+			// the client gets every page as it comes
+			for (int16_t i = sizeof(*page); i < header->payload_size; i += sizeof(struct log_record)) {
 				p = (struct log_record *)(payload + i);
 				t = p->time;
-				time = localtime(&t);
-				strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", time);
+				localtime_r(&t, &time);
+				strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", &time);
 				snprintf(message_buffer, sizeof(message_buffer),
 					"%s  %s\n", time_buffer, p->log_event < event_list_len ? log_event_list[p->log_event] : "UNEXPECTED");
 				message_buffer[sizeof(message_buffer) - 1] = '\0';
 				write_fifo(FIFO_CMD, message_buffer, strlen(message_buffer));
 			}
-			close(cmd_fifo_fd); cmd_fifo_fd = -1;
+			pthread_mutex_lock(&cmd_client_lock);
+			log_page_next = page->index + count;
+			done = log_page_next >= page->total;
+			if (done)
+				log_page_next = -1;
+			pthread_mutex_unlock(&cmd_client_lock);
+			if (done)
+				close_cmd_fifo();
 			break;
 		}
 		case WDT_UNKNOWN:
@@ -432,8 +678,52 @@ static void dispatch_wdt_payload(struct payload_header *header, const unsigned c
 	}
 }
 
+// Min-entropy of the k lowest bits of the samples: -log2 of the most frequent value.
+// The histogram has no correlation between the samples, so the result is an upper bound.
+static void format_rng_entropy(struct rng_histogram *p)
+{
+	uint32_t total = 0, counts[RNG_HISTOGRAM_BINS];
+	unsigned int bits, recommended = 0;
+	size_t len;
+	double h;
+
+	for (int i = 0; i < RNG_HISTOGRAM_BINS; i++)
+		total += p->counts[i];
+	len = snprintf(message_buffer, sizeof(message_buffer), "RNG entropy of the low-order bits (%" PRIu32 " samples)\n",
+		total);
+	if (total == 0)
+		return;
+
+	for (int i = 0; i < RNG_HISTOGRAM_BINS; i++)
+		counts[i] = p->counts[i];
+	// the bins of k bits are the sums of the bins of k + 1 bits
+	for (bits = RNG_HISTOGRAM_BITS; bits > 0; bits--) {
+		uint32_t max = 0;
+		for (int i = 0; i < (1 << bits); i++) {
+			if (counts[i] > max)
+				max = counts[i];
+		}
+		h = -log2((double)max / total);
+		if (recommended == 0 && h >= RNG_ENTROPY_RATIO * bits)
+			recommended = bits;
+		len += snprintf(message_buffer + len, sizeof(message_buffer) - len,
+			"%u bit(s): min-entropy %.3f (%.1f%%)\n", bits, h, 100.0 * h / bits);
+		// fold the upper half into the lower one for the next step
+		for (int i = 0; i < (1 << (bits - 1)); i++) {
+			counts[i] += counts[i + (1 << (bits - 1))];
+			counts[i + (1 << (bits - 1))] = 0;
+		}
+	}
+	if (recommended > 0)
+		snprintf(message_buffer + len, sizeof(message_buffer) - len, "Recommended: R4:%u\n", recommended);
+	else
+		snprintf(message_buffer + len, sizeof(message_buffer) - len, "Recommended: R4:0 (comparator)\n");
+}
+
 static void dispatch_rng_payload(struct payload_header *header, const unsigned char *payload)
 {
+	size_t len;
+
 	if ((enum command_type)header->type_id != CMD_RNG)
 		return;
 
@@ -445,10 +735,34 @@ static void dispatch_rng_payload(struct payload_header *header, const unsigned c
 		case RNG_STATUS: {
 			struct rng_status *p = (struct rng_status *)payload;
 			snprintf(message_buffer, sizeof(message_buffer),
-				"RNG [%" PRIu16 "] Threshold: %" PRIu8 "; Calibrated: %s; Flood: %s; Fault: %" PRIu16 "\n",
-				header->seq_num, p->threshold, p->calibrated ? "YES" : "NO", p->flood ? "ON" : "OFF", p->fault);
+				"RNG [%" PRIu16 "] Threshold: %" PRIu8 "; Calibrated: %s; Flood: %s; Fault: %" PRIu16 "\n"
+				"Extractor: %s; Raw bits: %" PRIu32 "; Emitted bits: %" PRIu32 " (%.1f%%)\n",
+				header->seq_num, p->threshold, p->calibrated ? "YES" : "NO", p->flood ? "ON" : "OFF", p->fault,
+				rng_extractor_list[p->extractor < RNG_EXTRACTOR_UNKNOWN ? p->extractor : RNG_EXTRACTOR_UNKNOWN],
+				p->raw_bits, p->emitted_bits, p->raw_bits ? 100.0 * p->emitted_bits / p->raw_bits : 0.0);
+			len = strlen(message_buffer);
+			if (p->sample_bits > 0)
+				snprintf(message_buffer + len, sizeof(message_buffer) - len,
+					"Sample bits: %" PRIu8 " (low-order)\n", p->sample_bits);
+			else
+				snprintf(message_buffer + len, sizeof(message_buffer) - len, "Sample bits: comparator\n");
+			len = strlen(message_buffer);
+			if (p->conditioner > 0)
+				snprintf(message_buffer + len, sizeof(message_buffer) - len,
+					"Conditioner: ARX %" PRIu8 ":1; Cycles per byte: %" PRIu16 "\n", p->conditioner, p->condition_cycles);
+			else
+				snprintf(message_buffer + len, sizeof(message_buffer) - len, "Conditioner: OFF\n");
+			len = strlen(message_buffer);
+			snprintf(message_buffer + len, sizeof(message_buffer) - len,
+				"Health: %s%s%s; Failures: %" PRIu16 "; Payload: %" PRIu8 " bytes\n",
+				p->health == RNG_HEALTH_OK ? "OK" : "FAILED",
+				(p->health & RNG_HEALTH_RCT) ? " (repetition count)" : "",
+				(p->health & RNG_HEALTH_APT) ? " (adaptive proportion)" : "", p->health_failures, p->payload_size);
 			break;
 		}
+		case RNG_HISTOGRAM:
+			format_rng_entropy((struct rng_histogram *)payload);
+			break;
 		case RNG_UNKNOWN:
 		default:
 			break;
@@ -497,7 +811,10 @@ void process_payload(struct payload_header *header, const unsigned char *payload
 			dispatch_rng_payload(header, payload);
 			break;
 		case CMD_RNG_SEND:
-			write_fifo(FIFO_RNG, (const char *)payload, header->payload_size);
+			if ((enum rng_send_command)header->cmd_id == RNG_SEND_RAW)
+				write_raw_capture(header, payload);
+			else
+				write_fifo(FIFO_RNG, (const char *)payload, header->payload_size);
 			break;
 		case CMD_NRF:
 			break;
@@ -513,6 +830,7 @@ static void dispatch_common_confirmation(struct payload_header *header)
 {
 	if ((enum command_type)header->type_id != CMD_COMMON)
 		return;
+	message_buffer[0] = '\0';  // most of the confirmations have no text
 
 	switch ((enum common_command)header->cmd_id) {
 		case COMMON_SYNC:
@@ -530,6 +848,10 @@ static void dispatch_common_confirmation(struct payload_header *header)
 		case COMMON_LOG_CLEAN:
 			snprintf(message_buffer, sizeof(message_buffer), "The device log has successfully been cleaned out.\n");
 			break;
+		case COMMON_SCHEDULER:
+			break;
+		case COMMON_BUDGET:
+			break;
 		case COMMON_UNKNOWN:
 		default:
 			break;
@@ -543,6 +865,7 @@ static void dispatch_wdt_confirmation(struct payload_header *header)
 {
 	if ((enum command_type)header->type_id != CMD_WDT)
 		return;
+	message_buffer[0] = '\0';  // most of the confirmations have no text
 
 	switch ((enum wdt_command)header->cmd_id) {
 		case WDT_KEEP_ALIVE:
@@ -590,6 +913,35 @@ void process_confirmation(struct payload_header *header)
 	}
 }
 
+void process_error(struct payload_header *header)
+{
+	const char *dev_name, *cmd_name;
+
+	if (header == NULL || header->payload_size >= 0)
+		return;
+
+	switch ((enum command_type)header->type_id) {
+		case CMD_COMMON:
+		case CMD_WDT:
+		case CMD_RNG:
+		case CMD_NRF:
+			// the device has refused the command, so the client will not get any other response
+			dev_name = get_device_name(header);
+			cmd_name = get_command_name(header);
+			snprintf(message_buffer, sizeof(message_buffer), "The device has refused the command %s:%s.\n",
+				dev_name != NULL ? dev_name : "UNEXPECTED", cmd_name != NULL ? cmd_name : "UNEXPECTED");
+			message_buffer[sizeof(message_buffer) - 1] = '\0';
+			write_fifo_and_close(FIFO_CMD, message_buffer, strlen(message_buffer), true);
+			break;
+		case CMD_RNG_SEND:
+			if ((enum rng_send_command)header->cmd_id == RNG_SEND_HEALTH)
+				log_message(WRND_ERROR, "RNG: The health tests have failed, the flood is paused until R0");
+			break;
+		default:
+			break;
+	}
+}
+
 /*** WDT ***/
 
 static void wdt_enable()
@@ -663,3 +1015,199 @@ void wrn_wdt_release()
 
 	wrn_wdt_ok_to_close = false;
 }
+
+/*** CMD ***/
+
+// returns false if the command must not be passed to the device
+static bool parse_client_command(char *cmd, bool *has_response, unsigned int *timeout)
+{
+	char type;
+	int id = 0;
+	size_t i;
+
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+	type = toupper(cmd[0]);
+	for (i = 1; isdigit(cmd[i]); i++)
+		id = id * 10 + (cmd[i] - '0');
+	if (i == 1 || i > 3)
+		return false;
+	for (; cmd[i] != '\0'; i++) {
+		if (cmd[i] != ':' && !isdigit(cmd[i]))
+			return false;
+	}
+
+	switch (type) {
+		case 'C':
+			if (id == COMMON_SYNC)  // the daemon owns the stream sync
+				return false;
+			*has_response = (id == COMMON_STATUS || id == COMMON_LOG_CLEAN || id == COMMON_SCHEDULER);
+			if (id == COMMON_LOG_CLEAN)
+				*timeout = COMMAND_LOG_CLEAN_TIMEOUT;
+			break;
+		case 'W':
+			*has_response = (id == WDT_STATUS || id == WDT_LOG);
+			if (id == WDT_LOG) {
+				char *n = strchr(cmd, ':');
+
+				pthread_mutex_lock(&cmd_client_lock);
+				log_page_next = -1;  // a new transfer
+				log_page_first = -1;
+				log_page_limit = n != NULL ? strtoul(n + 1, NULL, 10) : 0;
+				pthread_mutex_unlock(&cmd_client_lock);
+			}
+			break;
+		case 'R':
+			if (id == RNG_RAW && raw_capture_fd == -1)  // nowhere to write the samples
+				return false;
+			*has_response = (id == RNG_STATUS || id == RNG_HISTOGRAM);
+			break;
+		case 'N':
+			*has_response = true;  // the device has no NRF commands yet, an error is expected
+			break;
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+static bool read_client_command(int fd, char *cmd, size_t size)
+{
+	ssize_t n;
+	size_t len = 0;
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+	while (len < size - 1) {
+		if (poll(&pfd, 1, COMMAND_RESPONSE_TIMEOUT) <= 0)
+			return false;
+		n = read(fd, cmd + len, size - 1 - len);
+		if (n <= 0)
+			break;
+		len += n;
+		if (memchr(cmd, '\n', len) != NULL)
+			break;
+	}
+	cmd[len] = '\0';
+
+	return len > 0;
+}
+
+static void set_deadline(struct timespec *deadline, unsigned int timeout)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+// the timeout is for the whole response, but of every page for the paged W4
+static void wait_cmd_client(int fd, unsigned int timeout)
+{
+	struct timespec deadline;
+	unsigned long progress;
+	int ret = 0;
+
+	set_deadline(&deadline, timeout);
+	pthread_mutex_lock(&cmd_client_lock);
+	progress = cmd_client_progress;
+	while (cmd_client_fd == fd && ret == 0) {
+		ret = pthread_cond_timedwait(&cmd_client_done, &cmd_client_lock, &deadline);
+		if (cmd_client_progress != progress) {
+			progress = cmd_client_progress;
+			set_deadline(&deadline, timeout);
+			ret = 0;
+		}
+	}
+	if (cmd_client_fd == fd) {
+		log_message(WRND_ERROR, "CMD: No response from the device");
+		close(cmd_client_fd); cmd_client_fd = -1;
+	}
+	pthread_mutex_unlock(&cmd_client_lock);
+}
+
+static void serve_cmd_client(int fd)
+{
+	char cmd[COMMAND_MAX_SIZE];
+	bool has_response = false;
+	unsigned int timeout = COMMAND_RESPONSE_TIMEOUT;
+
+	if (!read_client_command(fd, cmd, sizeof(cmd)) || !parse_client_command(cmd, &has_response, &timeout)) {
+		close(fd);
+		return;
+	}
+
+	if ((enum verbose_level)arguments->verbose > VERBOSE_L0)
+		log_message(WRND_COMMON, "CMD: %s", cmd);
+
+	pthread_mutex_lock(&cmd_client_lock);
+	cmd_client_fd = fd;
+	pthread_mutex_unlock(&cmd_client_lock);
+
+	if (!device_write_command(cmd, "CMD:CLIENT") || !has_response) {
+		close_cmd_fifo();
+		return;
+	}
+
+	wait_cmd_client(fd, timeout);
+}
+
+static void *wrn_cmd_serve()
+{
+	int fd;
+
+	while (true) {
+		fd = accept(cmd_socket_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				log_message(WRND_ERROR, "CMD: Failed to accept a client: %s", strerror(errno));
+			continue;
+		}
+		// one client at a time, the device has a single response stream
+		serve_cmd_client(fd);
+	} // infinite loop
+
+	return (void *)0;
+}
+
+bool wrn_cmd_open()
+{
+	int ret;
+	struct sockaddr_un addr;
+
+	cmd_socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (cmd_socket_fd == -1) {
+		log_message(WRND_ERROR, "CMD: Cannot create the socket: %s", strerror(errno));
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, COMMAND_SOCKET, sizeof(addr.sun_path) - 1);
+	unlink(COMMAND_SOCKET);
+	if (bind(cmd_socket_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(COMMAND_SOCKET, 0660) == -1
+			|| listen(cmd_socket_fd, 8) == -1) {
+		log_message(WRND_ERROR, "CMD: Cannot listen on %s: %s", COMMAND_SOCKET, strerror(errno));
+		close(cmd_socket_fd); cmd_socket_fd = -1;
+		return false;
+	}
+
+	ret = pthread_create(&wrn_cmd_thread, NULL, &wrn_cmd_serve, NULL);
+	if (ret != 0) {
+		log_message(WRND_ERROR, "CMD: Failed to create the thread: %s", strerror(ret));
+		close(cmd_socket_fd); cmd_socket_fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+void wrn_cmd_close()
+{
+	pthread_cancel(wrn_cmd_thread);
+	pthread_join(wrn_cmd_thread, NULL);
+	close(cmd_socket_fd); cmd_socket_fd = -1;
+	unlink(COMMAND_SOCKET);
+}
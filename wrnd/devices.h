@@ -6,16 +6,36 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #define MAX_SYNC_SEQUENCE 8
 #define COMMAND_FIFO "/run/wrnd/cmd.fifo"
+#define COMMAND_SOCKET "/run/wrnd/cmd.sock"
 #define COMMAND_FEEDBACK_SIZE 2024
+#define COMMAND_MAX_SIZE 32
+#define COMMAND_RESPONSE_TIMEOUT 3000  // ms
+#define COMMAND_LOG_CLEAN_TIMEOUT 6000  // ms, C5 is confirmed when the whole EEPROM is erased
 
 #define WDT_MAGIC_CHAR 'V'
 #define WDT_MIN_KEEP_ALIVE_INTERVAL 1000  // ms
+#define WDT_LOG_PAGE 16  // records per frame of W4
 #define WDT_TIMEOUT_MIN 30
 #define WDT_TIMEOUT_MAX 300
 
+#define SCHED_TASKS 4  // NRF, RNG, WDT, CMD
+#define SCHED_TIMER1_CYCLES 64  // the budgets and the times are in the ticks of Timer1
+
+#define RNG_PAYLOAD_MIN 8
+#define RNG_PAYLOAD_MAX 128
+#define RNG_RAW_PAYLOAD_SIZE 62
+#define RNG_NOMINAL_RATE 1500  // bytes per second at one bit per ADC sample
+#define RNG_HISTOGRAM_BITS 4  // the lowest bits of the ADC samples
+#define RNG_SAMPLE_BITS_MAX RNG_HISTOGRAM_BITS  // no more bits than the entropy is estimated for
+#define RNG_HISTOGRAM_BINS (1 << RNG_HISTOGRAM_BITS)
+#define RNG_ENTROPY_RATIO 0.95  // min-entropy per bit to recommend the bit count
+#define RNG_CONDITIONER_MAX 8
+#define RNG_RAW_GAP 0xFFFF  // written to the capture file where the device dropped samples
+
 enum command_type {
 	CMD_COMMON = 0,
 	CMD_WDT,
@@ -33,6 +53,8 @@ enum common_command {
 	COMMON_RESET,
 	COMMON_PROGRAM,
 	COMMON_LOG_CLEAN,
+	COMMON_SCHEDULER,
+	COMMON_BUDGET,
 	COMMON_UNKNOWN
 };
 
@@ -49,9 +71,35 @@ enum rng_command {
 	RNG_FLOOD_ON = 0,
 	RNG_FLOOD_OFF,
 	RNG_STATUS,
+	RNG_EXTRACTOR,
+	RNG_SAMPLE_BITS,
+	RNG_HISTOGRAM,
+	RNG_RAW,
+	RNG_CONDITIONER,
+	RNG_PAYLOAD,
 	RNG_UNKNOWN
 };
 
+enum rng_extractor {
+	RNG_EXTRACTOR_LEGACY = 0,
+	RNG_EXTRACTOR_VON_NEUMANN,
+	RNG_EXTRACTOR_PERES,
+	RNG_EXTRACTOR_UNKNOWN
+};
+
+enum rng_health {
+	RNG_HEALTH_OK = 0,
+	RNG_HEALTH_RCT = 1,
+	RNG_HEALTH_APT = 2
+};
+
+enum rng_send_command {
+	RNG_SEND_PAYLOAD = 0,
+	RNG_SEND_RAW,
+	RNG_SEND_HEALTH,
+	RNG_SEND_UNKNOWN
+};
+
 enum nrf_forward_command {
 	NRF_FORWARD_L = 0,
 	NRF_FORWARD_UNKNOWN
@@ -84,6 +132,21 @@ struct common_status
 	uint8_t nlock;
 } __attribute__ ((__packed__));
 
+struct scheduler_task_stats
+{
+	uint16_t budget;
+	uint32_t runs;
+	uint16_t cuts;
+	uint16_t max_ticks;
+	uint32_t ticks;
+} __attribute__ ((__packed__));
+
+struct scheduler_stats
+{
+	uint32_t rounds;
+	struct scheduler_task_stats tasks[SCHED_TASKS];
+} __attribute__ ((__packed__));
+
 struct wdt_status
 {
 	uint8_t active;
@@ -98,6 +161,20 @@ struct rng_status
 	uint8_t calibrated;
 	uint8_t flood;
 	uint16_t fault;
+	uint8_t extractor;
+	uint32_t raw_bits;
+	uint32_t emitted_bits;
+	uint8_t sample_bits;
+	uint8_t conditioner;
+	uint16_t condition_cycles;
+	uint8_t health;
+	uint16_t health_failures;
+	uint8_t payload_size;
+} __attribute__ ((__packed__));
+
+struct rng_histogram
+{
+	uint16_t counts[RNG_HISTOGRAM_BINS];
 } __attribute__ ((__packed__));
 
 struct nrf_light
@@ -116,26 +193,41 @@ struct log_record
 	uint8_t log_event;
 } __attribute__ ((__packed__));
 
+// W4:n:start, the records of the page follow
+struct wdt_log_page
+{
+	uint16_t index;
+	uint16_t total;
+	uint16_t first;  // the EEPROM slot of the record 0, it moves when a record is written
+} __attribute__ ((__packed__));
+
 
 bool init_fifos();
 bool init_device();
+bool open_raw_capture();
 void close_device();
 
 bool device_write_command(const char *, const char *);
 bool device_send_sync(unsigned int);
 
+bool device_header_plausible(struct payload_header *);
 void log_device_header(struct payload_header *);
 void log_device_error(struct payload_header *);
 void log_device_payload(struct payload_header *, const unsigned char *);
 
 bool write_fifo(enum destination_fifo, const char *, size_t);
 bool write_fifo_and_close(enum destination_fifo, const char *, size_t, bool);
+bool write_rng_fifo(const struct iovec *, int);
 
 void process_payload(struct payload_header *, const unsigned char *);
 void process_confirmation(struct payload_header *);
+void process_error(struct payload_header *);
 
 bool wrn_wdt_open();
 void wrn_wdt_close();
 void wrn_wdt_release();
 
+bool wrn_cmd_open();
+void wrn_cmd_close();
+
 #endif /* DEVICES_H_ */
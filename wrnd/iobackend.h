@@ -0,0 +1,37 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef IOBACKEND_H_
+#define IOBACKEND_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define IO_BATCH_MAX 16  // frames per writev or linked chain
+#define IO_READ_BUFFERS 8  // provided buffers for the serial reads
+
+// The backend is selected at build time: make IO_BACKEND=blocking|uring
+struct io_stats {
+	atomic_ulong syscalls;
+	atomic_ulong bytes_read;
+	atomic_ulong bytes_written;
+};
+
+extern struct io_stats io_stats;
+extern const char *io_backend_name;
+
+// the serial reader; one per daemon
+bool io_reader_open(int);
+void io_reader_close();
+ssize_t io_read(const unsigned char **, int);  // bytes at *data; 0 - timeout (ms); -1 - error
+void io_read_done();
+
+// the calling thread's writer; the fixed buffer may be NULL
+bool io_writer_open(void *, size_t);
+void io_writer_close();
+ssize_t io_writev(int, const struct iovec *, int);  // stops at the first short write
+
+#endif /* IOBACKEND_H_ */
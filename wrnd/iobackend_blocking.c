@@ -0,0 +1,71 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include "iobackend.h"
+#include "wrnd.h"
+
+struct io_stats io_stats;
+const char *io_backend_name = "blocking";
+
+static int reader_fd = -1;
+static unsigned char reader_buffer[SERIAL_RX_CHUNK_SIZE];
+
+bool io_reader_open(int fd)
+{
+	reader_fd = fd;
+	return true;
+}
+
+void io_reader_close()
+{
+	reader_fd = -1;
+}
+
+ssize_t io_read(const unsigned char **data, int timeout)
+{
+	ssize_t n;
+	struct pollfd pfd = {.fd = reader_fd, .events = POLLIN};
+
+	n = poll(&pfd, 1, timeout);
+	atomic_fetch_add_explicit(&io_stats.syscalls, 1, memory_order_relaxed);
+	if (n <= 0)
+		return (n == -1 && errno == EINTR) ? 0 : n;
+
+	n = read(reader_fd, reader_buffer, sizeof(reader_buffer));
+	atomic_fetch_add_explicit(&io_stats.syscalls, 1, memory_order_relaxed);
+	if (n > 0)
+		atomic_fetch_add_explicit(&io_stats.bytes_read, n, memory_order_relaxed);
+	*data = reader_buffer;
+
+	return n;
+}
+
+void io_read_done()
+{
+}
+
+bool io_writer_open(void *fixed, size_t fixed_size)
+{
+	return true;
+}
+
+void io_writer_close()
+{
+}
+
+ssize_t io_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	n = writev(fd, iov, iovcnt);
+	atomic_fetch_add_explicit(&io_stats.syscalls, 1, memory_order_relaxed);
+	if (n > 0)
+		atomic_fetch_add_explicit(&io_stats.bytes_written, n, memory_order_relaxed);
+
+	return n;
+}
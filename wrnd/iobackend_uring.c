@@ -0,0 +1,444 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// io_uring backend without liburing: the daemon needs only a few operations,
+// so the rings are set up with the raw system calls.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "iobackend.h"
+#include "wrnd.h"
+
+#define URING_READER_ENTRIES 4
+#define URING_WRITER_ENTRIES (IO_BATCH_MAX * 2)
+#define URING_READ_GROUP 0
+// the kernel headers may be older than the kernel, since 6.7
+#define URING_OP_READ_MULTISHOT 49
+#define URING_READ_TAG 1
+
+struct uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned pending;  // sqes prepared, but not submitted yet
+};
+
+struct io_stats io_stats;
+const char *io_backend_name = "uring";
+
+static struct uring reader_ring = {.fd = -1};
+static int reader_fd = -1;
+static bool reader_multishot = true;
+static bool reader_armed = false;
+static struct io_uring_buf_ring *reader_bufs = NULL;
+static unsigned char *reader_pool = NULL;
+static int reader_bid = -1;  // the buffer given out by io_read()
+static unsigned char reader_buffer[SERIAL_RX_CHUNK_SIZE];  // fallback
+
+static __thread struct uring writer_ring = {.fd = -1};
+static __thread unsigned char *writer_fixed = NULL;
+static __thread size_t writer_fixed_size = 0;
+
+
+static int uring_enter(struct uring *ring, unsigned submit, unsigned wait, int timeout)
+{
+	int ret;
+	unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	void *argp = NULL;
+	size_t argsz = 0;
+
+	if (wait > 0 && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (unsigned long)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argsz = sizeof(arg);
+	}
+
+	ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, argp, argsz);
+	atomic_fetch_add_explicit(&io_stats.syscalls, 1, memory_order_relaxed);
+	if (ret >= 0)
+		ring->pending -= ((unsigned)ret < ring->pending ? (unsigned)ret : ring->pending);
+
+	return ret;
+}
+
+static bool uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd == -1)
+		return false;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(ring->fd); ring->fd = -1;
+		errno = ENOSYS;
+		return false;
+	}
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->cq_size > ring->sq_size)
+		ring->sq_size = ring->cq_size;
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto fail_ring;
+	ring->cq_ptr = ring->sq_ptr;
+	ring->cq_size = 0;  // shared with the SQ ring
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_sq;
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	return true;
+
+fail_sq:
+	munmap(ring->sq_ptr, ring->sq_size);
+fail_ring:
+	close(ring->fd); ring->fd = -1;
+	return false;
+}
+
+static void uring_exit(struct uring *ring)
+{
+	if (ring->fd == -1)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd); ring->fd = -1;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned index;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring->sq_entries)
+		return NULL;
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+
+	return sqe;
+}
+
+static struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*** Reader ***/
+
+static void reader_recycle(int bid)
+{
+	unsigned short tail = reader_bufs->tail;
+	struct io_uring_buf *buf = &reader_bufs->bufs[tail & (IO_READ_BUFFERS - 1)];
+
+	buf->addr = (unsigned long)(reader_pool + bid * SERIAL_RX_CHUNK_SIZE);
+	buf->len = SERIAL_RX_CHUNK_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&reader_bufs->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool reader_arm()
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&reader_ring);
+
+	if (sqe == NULL)
+		return false;
+
+	// one multishot read completes for every chunk that arrives on the port
+	sqe->opcode = reader_multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+	sqe->fd = reader_fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_READ_GROUP;
+	sqe->len = reader_multishot ? 0 : SERIAL_RX_CHUNK_SIZE;
+	sqe->user_data = URING_READ_TAG;
+	reader_armed = true;
+
+	return true;
+}
+
+static bool reader_setup_buffers()
+{
+	struct io_uring_buf_reg reg;
+	size_t size = IO_READ_BUFFERS * sizeof(struct io_uring_buf);
+
+	reader_bufs = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (reader_bufs == MAP_FAILED) {
+		reader_bufs = NULL;
+		return false;
+	}
+	reader_pool = malloc(IO_READ_BUFFERS * SERIAL_RX_CHUNK_SIZE);
+	if (reader_pool == NULL)
+		return false;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)reader_bufs;
+	reg.ring_entries = IO_READ_BUFFERS;
+	reg.bgid = URING_READ_GROUP;
+	if (syscall(__NR_io_uring_register, reader_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return false;
+
+	reader_bufs->tail = 0;
+	for (int i = 0; i < IO_READ_BUFFERS; i++)
+		reader_recycle(i);
+
+	return true;
+}
+
+static void reader_free_buffers()
+{
+	if (reader_bufs != NULL)
+		munmap(reader_bufs, IO_READ_BUFFERS * sizeof(struct io_uring_buf));
+	reader_bufs = NULL;
+	free(reader_pool); reader_pool = NULL;
+}
+
+bool io_reader_open(int fd)
+{
+	reader_fd = fd;
+	reader_bid = -1;
+	reader_armed = false;
+	reader_multishot = true;
+
+	if (!uring_init(&reader_ring, URING_READER_ENTRIES) || !reader_setup_buffers()) {
+		log_message(WRND_ERROR, "io_uring reader is not available, the blocking reads are used: %s", strerror(errno));
+		reader_free_buffers();
+		uring_exit(&reader_ring);
+	}
+
+	return true;
+}
+
+void io_reader_close()
+{
+	// closing the ring cancels the armed read
+	uring_exit(&reader_ring);
+	reader_free_buffers();
+	reader_fd = -1;
+}
+
+ssize_t io_read(const unsigned char **data, int timeout)
+{
+	ssize_t n;
+	struct io_uring_cqe *cqe;
+	unsigned flags;
+	struct pollfd pfd = {.fd = reader_fd, .events = POLLIN};
+
+	if (reader_ring.fd == -1) {
+		n = poll(&pfd, 1, timeout);
+		atomic_fetch_add_explicit(&io_stats.syscalls, 1, memory_order_relaxed);
+		if (n <= 0)
+			return (n == -1 && errno == EINTR) ? 0 : n;
+		n = read(reader_fd, reader_buffer, sizeof(reader_buffer));
+		atomic_fetch_add_explicit(&io_stats.syscalls, 1, memory_order_relaxed);
+		if (n > 0)
+			atomic_fetch_add_explicit(&io_stats.bytes_read, n, memory_order_relaxed);
+		*data = reader_buffer;
+		return n;
+	}
+
+	while (true) {
+		if (!reader_armed && !reader_arm())
+			return -1;
+
+		cqe = uring_peek_cqe(&reader_ring);
+		if (cqe == NULL) {
+			n = uring_enter(&reader_ring, reader_ring.pending, 1, timeout);
+			if (n == -1 && (errno == ETIME || errno == EINTR))
+				return 0;
+			if (n == -1)
+				return -1;
+			cqe = uring_peek_cqe(&reader_ring);
+			if (cqe == NULL)
+				return 0;
+		}
+
+		n = cqe->res;
+		flags = cqe->flags;
+		uring_cqe_seen(&reader_ring);
+		if (!(flags & IORING_CQE_F_MORE))
+			reader_armed = false;
+
+		if (n == -EINVAL && reader_multishot) {
+			// an older kernel, the reads are rearmed one by one
+			reader_multishot = false;
+			continue;
+		} else if (n == -ENOBUFS || n == -EAGAIN || n == -EINTR || n == 0)
+			continue;
+		else if (n < 0) {
+			errno = -n;
+			return -1;
+		}
+
+		reader_bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		atomic_fetch_add_explicit(&io_stats.bytes_read, n, memory_order_relaxed);
+		*data = reader_pool + reader_bid * SERIAL_RX_CHUNK_SIZE;
+		return n;
+	}
+}
+
+void io_read_done()
+{
+	if (reader_bid == -1)
+		return;
+
+	reader_recycle(reader_bid);
+	reader_bid = -1;
+}
+
+/*** Writer ***/
+
+bool io_writer_open(void *fixed, size_t fixed_size)
+{
+	struct iovec iov = {.iov_base = fixed, .iov_len = fixed_size};
+
+	if (!uring_init(&writer_ring, URING_WRITER_ENTRIES)) {
+		log_message(WRND_ERROR, "io_uring writer is not available, writev is used: %s", strerror(errno));
+		return true;
+	}
+
+	// RNG payloads are written straight from the registered ring slots
+	if (fixed != NULL && fixed_size > 0) {
+		if (syscall(__NR_io_uring_register, writer_ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+			writer_fixed = fixed;
+			writer_fixed_size = fixed_size;
+		} else
+			log_message(WRND_ERROR, "io_uring cannot register the buffers: %s", strerror(errno));
+	}
+
+	return true;
+}
+
+void io_writer_close()
+{
+	uring_exit(&writer_ring);
+	writer_fixed = NULL;
+	writer_fixed_size = 0;
+}
+
+ssize_t io_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t total = 0;
+	int error = 0, submitted, done = 0;
+	unsigned char *base;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	if (writer_ring.fd == -1) {
+		total = writev(fd, iov, iovcnt);
+		atomic_fetch_add_explicit(&io_stats.syscalls, 1, memory_order_relaxed);
+		if (total > 0)
+			atomic_fetch_add_explicit(&io_stats.bytes_written, total, memory_order_relaxed);
+		return total;
+	}
+
+	if (iovcnt > URING_WRITER_ENTRIES)
+		iovcnt = URING_WRITER_ENTRIES;
+
+	// the writes are linked, a short write cancels the rest of the chain
+	for (submitted = 0; submitted < iovcnt; submitted++) {
+		sqe = uring_get_sqe(&writer_ring);
+		if (sqe == NULL)
+			break;
+		base = iov[submitted].iov_base;
+		if (writer_fixed != NULL && base >= writer_fixed
+				&& base + iov[submitted].iov_len <= writer_fixed + writer_fixed_size) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->buf_index = 0;
+		} else
+			sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long)base;
+		sqe->len = iov[submitted].iov_len;
+		sqe->user_data = submitted;
+		if (submitted < iovcnt - 1)
+			sqe->flags = IOSQE_IO_LINK;
+	}
+	if (submitted == 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (submitted < iovcnt)
+		writer_ring.sqes[(*writer_ring.sq_tail - 1) & *writer_ring.sq_mask].flags &= ~IOSQE_IO_LINK;
+
+	if (uring_enter(&writer_ring, writer_ring.pending, submitted, -1) == -1 && errno != EINTR)
+		return -1;
+
+	while (done < submitted) {
+		cqe = uring_peek_cqe(&writer_ring);
+		if (cqe == NULL) {
+			if (uring_enter(&writer_ring, 0, submitted - done, -1) == -1 && errno != EINTR)
+				return -1;
+			continue;
+		}
+		if (cqe->res > 0 && error == 0)
+			total += cqe->res;
+		else if (cqe->res < 0 && error == 0)
+			error = -cqe->res;
+		if (cqe->res >= 0 && (size_t)cqe->res < iov[cqe->user_data].iov_len && error == 0)
+			error = EAGAIN;  // short write, the caller resumes from total
+		uring_cqe_seen(&writer_ring);
+		done++;
+	}
+
+	if (total > 0)
+		atomic_fetch_add_explicit(&io_stats.bytes_written, total, memory_order_relaxed);
+	if (total == 0 && error != 0) {
+		errno = error;
+		return -1;
+	}
+
+	return total;
+}
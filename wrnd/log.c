@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include "log.h"
 #include "wrnd.h"
 
@@ -22,6 +23,7 @@ static FILE *fp_error = NULL, *fp_common = NULL, *fp_wdt = NULL, *fp_rng = NULL,
 static ino_t ino_error = 0, ino_common = 0, ino_wdt = 0, ino_rng = 0, ino_nrf = 0; 
 static char message_buffer[MESSAGE_BUFFER_SIZE];
 static char time_buffer[21];
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static FILE *open_log(const char *fname, ino_t *ino)
 {
@@ -142,8 +144,15 @@ bool wrndlog(enum log_destination dest, const char *fmt, ...)
 	bool ret;
 	va_list args;
 
+	if (dest > WRND_NRF) {
+		log_message(WRND_ERROR, "Invalid log destination: %d", dest);
+		return false;
+	}
+
+	// the buffers are shared by all the daemon threads
+	pthread_mutex_lock(&log_lock);
 	va_start(args, fmt);
-	vsprintf(message_buffer, fmt, args);
+	vsnprintf(message_buffer, sizeof(message_buffer), fmt, args);
 	va_end(args);
 	message_buffer[sizeof(message_buffer) - 1] = '\0';
 
@@ -164,9 +173,10 @@ bool wrndlog(enum log_destination dest, const char *fmt, ...)
 			ret = write_message(fp_nrf, message_buffer);
 			break;
 		default:
-			log_message(WRND_ERROR, "Invalid log destination: %d", dest);
-			return false;
+			ret = false;
+			break;
 	}
+	pthread_mutex_unlock(&log_lock);
 
 	return ret;
 }
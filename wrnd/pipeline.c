@@ -0,0 +1,176 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "ring.h"
+#include "devices.h"
+#include "iobackend.h"
+#include "sink.h"
+#include "wrnd.h"
+
+// The serial reader only parses frames, everything that may block or take time
+// (formatting, localtime, FIFO writes) is done by a worker per destination.
+struct worker {
+	struct ring ring;
+	pthread_t thread;
+	bool started;
+};
+
+static struct worker rng_worker, nrf_worker, cmd_worker;
+
+
+static void process_frame(struct frame *frame)
+{
+	struct payload_header *header = &frame->header;
+
+	if ((enum verbose_level)arguments->verbose > VERBOSE_L1)
+		log_device_header(header);
+
+	if (header->payload_size < 0) {
+		log_device_error(header);
+		process_error(header);
+	} else if (header->payload_size == 0)
+		process_confirmation(header);
+	else {
+		if ((enum verbose_level)arguments->verbose > VERBOSE_L2)
+			log_device_payload(header, frame->payload);
+		process_payload(header, frame->payload);
+	}
+}
+
+static void *worker_loop(void *arg)
+{
+	struct worker *worker = arg;
+	struct frame *frame;
+
+	while ((frame = ring_front(&worker->ring)) != NULL) {
+		process_frame(frame);
+		ring_pop(&worker->ring);
+	}
+
+	return (void *)0;
+}
+
+// a batch of payloads is queued to the RNG sink at once
+static void *rng_worker_loop(void *arg)
+{
+	struct worker *worker = arg;
+	struct frame *frames[IO_BATCH_MAX];
+	struct iovec iov[IO_BATCH_MAX];
+	size_t n;
+	int iovcnt;
+
+	while ((n = ring_front_batch(&worker->ring, frames, IO_BATCH_MAX)) > 0) {
+		iovcnt = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (frames[i]->header.payload_size <= 0 || (enum rng_send_command)frames[i]->header.cmd_id != RNG_SEND_PAYLOAD) {
+				process_frame(frames[i]);
+				continue;
+			}
+			if ((enum verbose_level)arguments->verbose > VERBOSE_L1)
+				log_device_header(&frames[i]->header);
+			if ((enum verbose_level)arguments->verbose > VERBOSE_L2)
+				log_device_payload(&frames[i]->header, frames[i]->payload);
+			iov[iovcnt].iov_base = frames[i]->payload;
+			iov[iovcnt].iov_len = frames[i]->header.payload_size;
+			iovcnt++;
+		}
+		if (iovcnt > 0)
+			write_rng_fifo(iov, iovcnt);
+		ring_pop_batch(&worker->ring, n);
+	}
+
+	return (void *)0;
+}
+
+static bool worker_start(struct worker *worker, const char *name, size_t size, void *(*loop)(void *))
+{
+	int ret;
+
+	if (!ring_init(&worker->ring, name, size))
+		return false;
+
+	ret = pthread_create(&worker->thread, NULL, loop, worker);
+	if (ret != 0) {
+		log_message(WRND_ERROR, "Failed to create the %s worker thread: %s", name, strerror(ret));
+		ring_free(&worker->ring);
+		return false;
+	}
+	worker->started = true;
+
+	return true;
+}
+
+static void worker_stop(struct worker *worker)
+{
+	if (!worker->started)
+		return;
+
+	ring_close(&worker->ring);  // the worker drains the ring and exits
+	pthread_join(worker->thread, NULL);
+	log_ring_stats(&worker->ring);
+	ring_free(&worker->ring);
+	worker->started = false;
+}
+
+bool pipeline_start()
+{
+	if (!sinks_start())
+		return false;
+
+	if (worker_start(&rng_worker, "RNG", RNG_RING_SIZE, &rng_worker_loop)
+			&& worker_start(&nrf_worker, "NRF", NRF_RING_SIZE, &worker_loop)
+			&& worker_start(&cmd_worker, "CMD", CMD_RING_SIZE, &worker_loop))
+		return true;
+
+	pipeline_stop();
+	return false;
+}
+
+static void log_io_stats()
+{
+	log_message(WRND_COMMON, "I/O %s: syscalls %lu; read %lu; written %lu", io_backend_name,
+		atomic_load(&io_stats.syscalls), atomic_load(&io_stats.bytes_read), atomic_load(&io_stats.bytes_written));
+}
+
+void pipeline_stop()
+{
+	sinks_release();
+	worker_stop(&rng_worker);
+	worker_stop(&nrf_worker);
+	worker_stop(&cmd_worker);
+	sinks_stop();
+	log_io_stats();
+}
+
+bool pipeline_push(struct payload_header *header, const unsigned char *payload)
+{
+	struct worker *worker;
+
+	switch ((enum command_type)header->type_id) {
+		case CMD_RNG_SEND:
+			worker = &rng_worker;
+			break;
+		case CMD_NRF:
+		case CMD_NRF_FORWARD:
+			worker = &nrf_worker;
+			break;
+		default:
+			worker = &cmd_worker;
+			break;
+	}
+
+	return ring_push(&worker->ring, header, payload);
+}
+
+void log_pipeline_stats()
+{
+	log_ring_stats(&rng_worker.ring);
+	log_ring_stats(&nrf_worker.ring);
+	log_ring_stats(&cmd_worker.ring);
+	log_sink_stats();
+	log_io_stats();
+}
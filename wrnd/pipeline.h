@@ -0,0 +1,19 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdbool.h>
+#include "devices.h"
+
+#define RNG_RING_SIZE 64  // frames
+#define NRF_RING_SIZE 16
+#define CMD_RING_SIZE 16
+
+bool pipeline_start();
+void pipeline_stop();
+bool pipeline_push(struct payload_header *, const unsigned char *);
+void log_pipeline_stats();
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,135 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ring.h"
+#include "wrnd.h"
+
+bool ring_init(struct ring *ring, const char *name, size_t size)
+{
+	if (ring == NULL || size == 0 || (size & (size - 1)) != 0)
+		return false;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->name = name;
+	ring->size = size;
+	ring->frames = malloc(size * sizeof(struct frame));
+	if (ring->frames == NULL) {
+		log_message(WRND_ERROR, "Cannot allocate required memory: ring %s", name);
+		return false;
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->high_water, 0);
+	atomic_init(&ring->pushed, 0);
+	atomic_init(&ring->dropped, 0);
+	if (sem_init(&ring->items, 0, 0) == -1) {
+		log_message(WRND_ERROR, "Cannot initialize the ring %s: %s", name, strerror(errno));
+		free(ring->frames); ring->frames = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+void ring_free(struct ring *ring)
+{
+	if (ring == NULL || ring->frames == NULL)
+		return;
+
+	sem_destroy(&ring->items);
+	free(ring->frames); ring->frames = NULL;
+}
+
+// never blocks, the frame is dropped if the consumer is behind
+bool ring_push(struct ring *ring, const struct payload_header *header, const unsigned char *payload)
+{
+	size_t head, tail, size;
+	struct frame *frame;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail >= ring->size) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		if (!ring->overflow) {
+			ring->overflow = true;
+			log_message(WRND_ERROR, "Ring %s is full, frames are dropped", ring->name);
+		}
+		return false;
+	}
+	ring->overflow = false;
+
+	frame = &ring->frames[head & (ring->size - 1)];
+	frame->header = *header;
+	size = header->payload_size > 0 ? header->payload_size : 0;
+	if (size > sizeof(frame->payload))
+		size = sizeof(frame->payload);
+	if (size > 0 && payload != NULL)
+		memcpy(frame->payload, payload, size);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+	if (head + 1 - tail > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+		atomic_store_explicit(&ring->high_water, head + 1 - tail, memory_order_relaxed);
+	sem_post(&ring->items);
+
+	return true;
+}
+
+// blocks until a frame is available; NULL when the ring is closed and drained
+struct frame *ring_front(struct ring *ring)
+{
+	struct frame *frame;
+
+	if (ring_front_batch(ring, &frame, 1) == 0)
+		return NULL;
+
+	return frame;
+}
+
+// blocks for the first frame, then takes the ones that are already there
+size_t ring_front_batch(struct ring *ring, struct frame **frames, size_t max)
+{
+	size_t head, tail, n;
+
+	while (sem_wait(&ring->items) == -1 && errno == EINTR);
+	for (n = 1; n < max && sem_trywait(&ring->items) == 0; n++);
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (n > head - tail) {
+		// one of the tokens was posted by ring_close(), keep it for the next call
+		sem_post(&ring->items);
+		n = head - tail;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		frames[i] = &ring->frames[(tail + i) & (ring->size - 1)];
+
+	return n;
+}
+
+void ring_pop(struct ring *ring)
+{
+	ring_pop_batch(ring, 1);
+}
+
+void ring_pop_batch(struct ring *ring, size_t n)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+void ring_close(struct ring *ring)
+{
+	sem_post(&ring->items);
+}
+
+void log_ring_stats(struct ring *ring)
+{
+	log_message(WRND_COMMON, "Ring %s: pushed %lu; dropped %lu; high-water %zu/%zu", ring->name,
+		atomic_load(&ring->pushed), atomic_load(&ring->dropped), atomic_load(&ring->high_water), ring->size);
+}
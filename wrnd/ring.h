@@ -0,0 +1,44 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include "wrnd.h"
+#include "devices.h"
+
+struct frame {
+	struct payload_header header;
+	unsigned char payload[SERIAL_RX_BUFFER_SIZE];
+};
+
+// Single producer (the serial reader), single consumer (a sink worker)
+struct ring {
+	const char *name;
+	size_t size;  // power of 2
+	struct frame *frames;
+	atomic_size_t head;  // next slot to be written by the producer
+	atomic_size_t tail;  // next slot to be read by the consumer
+	sem_t items;  // wakes up the consumer
+	bool overflow;  // the producer is dropping frames right now
+	// metrics
+	atomic_size_t high_water;
+	atomic_ulong pushed;
+	atomic_ulong dropped;
+};
+
+bool ring_init(struct ring *, const char *, size_t);
+void ring_free(struct ring *);
+bool ring_push(struct ring *, const struct payload_header *, const unsigned char *);
+struct frame *ring_front(struct ring *);
+size_t ring_front_batch(struct ring *, struct frame **, size_t);
+void ring_pop(struct ring *);
+void ring_pop_batch(struct ring *, size_t);
+void ring_close(struct ring *);
+void log_ring_stats(struct ring *);
+
+#endif /* RING_H_ */
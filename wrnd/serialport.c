@@ -73,3 +73,14 @@ int serialport_init(const char* serialport, unsigned int speed, unsigned char vt
 
 	return -1;
 }
+
+// discards the data received but not read
+bool serialport_flush(int fd)
+{
+	if (ioctl(fd, TCFLSH, TCIFLUSH) != 0) {
+		log_message(WRND_ERROR, "Cannot flush the serial port: %s", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
@@ -4,6 +4,9 @@
 #ifndef SERIALPORT_H_
 #define SERIALPORT_H_
 
+#include <stdbool.h>
+
 int serialport_init(const char*, unsigned int, unsigned char);
+bool serialport_flush(int);
 
 #endif /* SERIALPORT_H_ */
@@ -0,0 +1,422 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "sink.h"
+#include "iobackend.h"
+#include "wrnd.h"
+
+// Every FIFO has its own bounded queue, a single writer thread drains the queues
+// with non-blocking writes and resumes a partially written entry on POLLOUT.
+enum sink_id {
+	SINK_CMD = 0,
+	SINK_RNG,
+	SINK_NRF,
+	SINK_COUNT
+};
+
+static const char *policy_names[] = {"drop-oldest", "drop-newest", "block"};
+
+static struct sink sinks[SINK_COUNT];
+static pthread_t sink_thread;
+static int sink_event_fd = -1;
+static bool sinks_running = false;
+
+
+enum sink_policy sink_policy_parse(const char *name)
+{
+	for (int i = 0; i < SINK_UNKNOWN; i++)
+		if (strcmp(name, policy_names[i]) == 0)
+			return (enum sink_policy)i;
+
+	return SINK_UNKNOWN;
+}
+
+const char *sink_policy_name(enum sink_policy policy)
+{
+	return policy < SINK_UNKNOWN ? policy_names[policy] : "unknown";
+}
+
+static bool sink_init(struct sink *sink, const char *name, const char *path, size_t size, enum sink_policy policy)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->name = name;
+	sink->path = path;
+	sink->fd = -1;
+	sink->policy = policy;
+	sink->size = size;
+	sink->entries = malloc(size * sizeof(struct sink_entry));
+	if (sink->entries == NULL) {
+		log_message(WRND_ERROR, "Cannot allocate required memory: sink %s", name);
+		return false;
+	}
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_cond_init(&sink->space, NULL);
+
+	return true;
+}
+
+static void sink_free(struct sink *sink)
+{
+	if (sink->entries == NULL)
+		return;
+
+	if (sink->fd != -1) {
+		close(sink->fd); sink->fd = -1;
+	}
+	pthread_cond_destroy(&sink->space);
+	pthread_mutex_destroy(&sink->lock);
+	free(sink->entries); sink->entries = NULL;
+}
+
+static void sink_wakeup()
+{
+	uint64_t one = 1;
+
+	if (write(sink_event_fd, &one, sizeof(one)) == -1)
+		return;  // the counter is already non-zero
+}
+
+// the head entry leaves the queue, the caller holds the lock
+static void sink_pop(struct sink *sink)
+{
+	sink->head = (sink->head + 1) % sink->size;
+	sink->count--;
+	sink->offset = 0;
+	pthread_cond_signal(&sink->space);
+}
+
+static void sink_drop_oldest(struct sink *sink)
+{
+	size_t next;
+	bool close_after;
+
+	if (sink->offset > 0 && sink->count > 1) {
+		// the head is partially written, so the next entry takes its place
+		next = (sink->head + 1) % sink->size;
+		close_after = sink->entries[next].close_after;
+		sink->entries[next] = sink->entries[sink->head];
+		sink->entries[next].close_after |= close_after;
+		sink->head = next;
+		sink->count--;
+	} else {
+		close_after = sink->entries[sink->head].close_after;
+		sink_pop(sink);
+		if (close_after && sink->count > 0)
+			sink->entries[sink->head].close_after = true;
+	}
+	sink->dropped++;
+}
+
+// returns false if the entry has to be dropped
+static bool sink_reserve(struct sink *sink)
+{
+	while (sink->count >= sink->size) {
+		switch (sink->released ? SINK_DROP_NEWEST : sink->policy) {
+			case SINK_DROP_OLDEST:
+				sink_drop_oldest(sink);
+				break;
+			case SINK_BLOCK:
+				pthread_cond_wait(&sink->space, &sink->lock);
+				break;
+			default:
+				sink->dropped++;
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void sink_close_fd(struct sink *sink)
+{
+	close(sink->fd); sink->fd = -1;
+}
+
+// consumes n written bytes, the caller holds the lock
+static void sink_advance(struct sink *sink, size_t n)
+{
+	struct sink_entry *entry;
+
+	while (sink->count > 0) {
+		entry = &sink->entries[sink->head];
+		if (sink->offset + n < entry->len) {
+			sink->offset += n;
+			return;
+		}
+		n -= entry->len - sink->offset;
+		sink->delivered++;
+		sink->bytes += entry->len;
+		sink_pop(sink);
+		if (entry->close_after) {  // unblock the reader
+			sink_close_fd(sink);
+			return;
+		}
+	}
+}
+
+// writes as much as the FIFO accepts, the caller holds the lock
+static void sink_flush(struct sink *sink)
+{
+	struct iovec iov[IO_BATCH_MAX];
+	struct sink_entry *entry;
+	size_t requested;
+	ssize_t n;
+	int iovcnt;
+
+	while (sink->count > 0 && sink->fd != -1) {
+		requested = 0;
+		for (iovcnt = 0; iovcnt < IO_BATCH_MAX && (size_t)iovcnt < sink->count; iovcnt++) {
+			entry = &sink->entries[(sink->head + iovcnt) % sink->size];
+			iov[iovcnt].iov_base = entry->data + (iovcnt == 0 ? sink->offset : 0);
+			iov[iovcnt].iov_len = entry->len - (iovcnt == 0 ? sink->offset : 0);
+			requested += iov[iovcnt].iov_len;
+			if (entry->close_after) {
+				iovcnt++;
+				break;
+			}
+		}
+
+		n = io_writev(sink->fd, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			// the reader has gone, the rest of a partial entry is useless for the next one
+			if (sink->offset > 0) {
+				sink_pop(sink);
+				sink->dropped++;
+			}
+			sink_close_fd(sink);
+			return;
+		}
+		sink_advance(sink, n);
+		if ((size_t)n < requested)
+			return;  // wait for POLLOUT
+	}
+}
+
+// Open returns -1 (ENXIO) while no process has the FIFO open for reading. A response is
+// for the reader which waits for it, so then the command sink drops its entries and the
+// other sinks the entries up to the last close: the next reader must not get the answers
+// to the commands it has not sent.
+static void sink_open(struct sink *sink)
+{
+	size_t drop = 0;
+
+	if (sink->fd != -1)
+		return;
+	sink->fd = open(sink->path, O_WRONLY | O_NONBLOCK);
+	if (sink->fd != -1 || errno != ENXIO)
+		return;
+
+	if (sink == &sinks[SINK_CMD]) {
+		drop = sink->count;
+	} else {
+		for (size_t i = 0; i < sink->count; i++) {
+			if (sink->entries[(sink->head + i) % sink->size].close_after)
+				drop = i + 1;
+		}
+	}
+	for (; drop > 0; drop--) {
+		sink_pop(sink);
+		sink->dropped++;
+	}
+}
+
+static void *sink_serve()
+{
+	struct pollfd pfd[SINK_COUNT + 1];
+	uint64_t events;
+	int nfds, timeout;
+
+	io_writer_open(sinks[SINK_RNG].entries, sinks[SINK_RNG].size * sizeof(struct sink_entry));
+	while (sinks_running) {
+		pfd[0].fd = sink_event_fd;
+		pfd[0].events = POLLIN;
+		nfds = 1;
+		timeout = -1;
+		for (int i = 0; i < SINK_COUNT; i++) {
+			pthread_mutex_lock(&sinks[i].lock);
+			if (sinks[i].count > 0) {
+				sink_open(&sinks[i]);
+				sink_flush(&sinks[i]);
+				if (sinks[i].count > 0 && sinks[i].fd == -1)
+					timeout = SINK_RETRY_INTERVAL;
+				else if (sinks[i].count > 0) {
+					pfd[nfds].fd = sinks[i].fd;
+					pfd[nfds].events = POLLOUT;  // POLLERR - the reader has gone
+					nfds++;
+				}
+			}
+			pthread_mutex_unlock(&sinks[i].lock);
+		}
+
+		if (poll(pfd, nfds, timeout) == -1 && errno != EINTR) {
+			log_message(WRND_ERROR, "Sink poll error: %s", strerror(errno));
+			break;
+		}
+		if (pfd[0].revents & POLLIN && read(sink_event_fd, &events, sizeof(events)) == -1)
+			continue;
+	}
+
+	// one last attempt for the readers which are still there
+	for (int i = 0; i < SINK_COUNT; i++) {
+		pthread_mutex_lock(&sinks[i].lock);
+		sink_flush(&sinks[i]);
+		pthread_mutex_unlock(&sinks[i].lock);
+	}
+	io_writer_close();
+
+	return (void *)0;
+}
+
+bool sinks_start()
+{
+	int ret;
+
+	if (!sink_init(&sinks[SINK_CMD], "CMD", COMMAND_FIFO, CMD_SINK_SIZE, arguments->cmd_policy)
+			|| !sink_init(&sinks[SINK_RNG], "RNG", arguments->rng_fifo, RNG_SINK_SIZE, arguments->rng_policy)
+			|| !sink_init(&sinks[SINK_NRF], "NRF", arguments->nrf_fifo, NRF_SINK_SIZE, arguments->nrf_policy)) {
+		for (int i = 0; i < SINK_COUNT; i++)
+			sink_free(&sinks[i]);
+		return false;
+	}
+
+	sink_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sink_event_fd == -1) {
+		log_message(WRND_ERROR, "Cannot create the sink event: %s", strerror(errno));
+		for (int i = 0; i < SINK_COUNT; i++)
+			sink_free(&sinks[i]);
+		return false;
+	}
+
+	sinks_running = true;
+	ret = pthread_create(&sink_thread, NULL, sink_serve, NULL);
+	if (ret != 0) {
+		log_message(WRND_ERROR, "Failed to create the sink thread: %s", strerror(ret));
+		sinks_running = false;
+		close(sink_event_fd); sink_event_fd = -1;
+		for (int i = 0; i < SINK_COUNT; i++)
+			sink_free(&sinks[i]);
+		return false;
+	}
+
+	return true;
+}
+
+// the blocked workers must be able to finish
+void sinks_release()
+{
+	for (int i = 0; i < SINK_COUNT; i++) {
+		if (sinks[i].entries == NULL)
+			continue;
+		pthread_mutex_lock(&sinks[i].lock);
+		sinks[i].released = true;
+		pthread_cond_broadcast(&sinks[i].space);
+		pthread_mutex_unlock(&sinks[i].lock);
+	}
+}
+
+void sinks_stop()
+{
+	if (!sinks_running)
+		return;
+
+	sinks_running = false;
+	sink_wakeup();
+	pthread_join(sink_thread, NULL);
+	log_sink_stats();
+	close(sink_event_fd); sink_event_fd = -1;
+	for (int i = 0; i < SINK_COUNT; i++)
+		sink_free(&sinks[i]);
+}
+
+// the message is queued, never written by the caller
+bool sink_write(enum destination_fifo dest, const struct iovec *iov, int iovcnt, bool close_after)
+{
+	struct sink *sink;
+	struct sink_entry *entry = NULL;
+	size_t copied = 0, n;
+	bool was_empty;
+
+	switch (dest) {
+		case FIFO_CMD:
+			sink = &sinks[SINK_CMD];
+			break;
+		case FIFO_RNG:
+			sink = &sinks[SINK_RNG];
+			break;
+		case FIFO_NRF:
+			sink = &sinks[SINK_NRF];
+			break;
+		default:
+			return false;
+	}
+	if (sink->entries == NULL)
+		return false;
+
+	pthread_mutex_lock(&sink->lock);
+	was_empty = sink->count == 0;
+	for (int i = 0; i < iovcnt; i++) {
+		for (size_t off = 0; off < iov[i].iov_len; off += n) {
+			if (entry == NULL || entry->len == SINK_ENTRY_SIZE) {
+				if (!sink_reserve(sink)) {
+					pthread_mutex_unlock(&sink->lock);
+					return false;
+				}
+				entry = &sink->entries[(sink->head + sink->count) % sink->size];
+				entry->len = 0;
+				entry->close_after = false;
+				sink->count++;
+				sink->enqueued++;
+			}
+			n = iov[i].iov_len - off;
+			if (n > SINK_ENTRY_SIZE - entry->len)
+				n = SINK_ENTRY_SIZE - entry->len;
+			memcpy(entry->data + entry->len, (unsigned char *)iov[i].iov_base + off, n);
+			entry->len += n;
+			copied += n;
+		}
+	}
+	if (close_after) {
+		if (entry == NULL) {  // nothing to write, only EOF for the reader
+			if (!sink_reserve(sink)) {
+				pthread_mutex_unlock(&sink->lock);
+				return false;
+			}
+			entry = &sink->entries[(sink->head + sink->count) % sink->size];
+			entry->len = 0;
+			sink->count++;
+			sink->enqueued++;
+		}
+		entry->close_after = true;
+	}
+	pthread_mutex_unlock(&sink->lock);
+
+	if (was_empty && (copied > 0 || close_after))
+		sink_wakeup();
+
+	return true;
+}
+
+void log_sink_stats()
+{
+	for (int i = 0; i < SINK_COUNT; i++) {
+		if (sinks[i].entries == NULL)
+			continue;
+		pthread_mutex_lock(&sinks[i].lock);
+		log_message(WRND_COMMON, "Sink %s (%s): enqueued %lu; delivered %lu; dropped %lu; bytes %llu; queued %zu/%zu",
+			sinks[i].name, sink_policy_name(sinks[i].policy), sinks[i].enqueued, sinks[i].delivered,
+			sinks[i].dropped, sinks[i].bytes, sinks[i].count, sinks[i].size);
+		pthread_mutex_unlock(&sinks[i].lock);
+	}
+}
@@ -0,0 +1,62 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#ifndef SINK_H_
+#define SINK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "devices.h"
+
+#define SINK_ENTRY_SIZE 2048  // bytes, longer messages take several entries
+#define RNG_SINK_SIZE 64  // entries
+#define NRF_SINK_SIZE 32
+#define CMD_SINK_SIZE 16
+#define SINK_RETRY_INTERVAL 1000  // ms between the attempts to open a FIFO without a reader
+
+// what to do when a FIFO reader does not keep up
+enum sink_policy {
+	SINK_DROP_OLDEST = 0,
+	SINK_DROP_NEWEST,
+	SINK_BLOCK,  // the worker of this sink waits, the others are not affected
+	SINK_UNKNOWN
+};
+
+struct sink_entry {
+	size_t len;
+	bool close_after;  // the reader gets EOF after this entry
+	unsigned char data[SINK_ENTRY_SIZE];
+};
+
+struct sink {
+	const char *name;
+	const char *path;
+	int fd;
+	enum sink_policy policy;
+	size_t size;
+	struct sink_entry *entries;
+	size_t head;
+	size_t count;
+	size_t offset;  // bytes of the head entry already written
+	bool released;  // no more blocking, the daemon is stopping
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+	// metrics
+	unsigned long enqueued;
+	unsigned long delivered;
+	unsigned long dropped;
+	unsigned long long bytes;
+};
+
+enum sink_policy sink_policy_parse(const char *);
+const char *sink_policy_name(enum sink_policy);
+
+bool sinks_start();
+void sinks_release();
+void sinks_stop();
+bool sink_write(enum destination_fifo, const struct iovec *, int, bool);
+void log_sink_stats();
+
+#endif /* SINK_H_ */
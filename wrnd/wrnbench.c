@@ -0,0 +1,206 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+// Streams RNG frames through a pty into the reader -> ring -> worker -> pipe
+// path of the daemon and reports syscalls and CPU per MB for the I/O backend.
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "wrnd.h"
+#include "ring.h"
+#include "iobackend.h"
+
+#define BENCH_PAYLOAD_SIZE 32  // the device sends RNG payloads of this size
+#define BENCH_DATA_SIZE (8 * 1024 * 1024)
+#define BENCH_RING_SIZE 64
+
+struct arguments bench_arguments = {.verbose = 0, .daemonize = false};
+struct arguments *arguments = &bench_arguments;
+int serial_fd = -1;
+
+static struct ring ring;
+static int pty_master = -1, pipe_fd[2] = {-1, -1};
+static double reader_cpu, worker_cpu;
+
+static double thread_cpu()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void *generate()
+{
+	unsigned char frame[sizeof(struct payload_header) + BENCH_PAYLOAD_SIZE];
+	struct payload_header *header = (struct payload_header *)frame;
+	size_t sent = 0;
+	ssize_t n;
+
+	header->type_id = CMD_RNG_SEND;
+	header->cmd_id = RNG_SEND_PAYLOAD;
+	header->seq_num = 0;
+	header->payload_size = BENCH_PAYLOAD_SIZE;
+	for (int i = 0; i < BENCH_PAYLOAD_SIZE; i++)
+		frame[sizeof(struct payload_header) + i] = (unsigned char)rand();
+
+	while (sent < BENCH_DATA_SIZE) {
+		for (size_t off = 0; off < sizeof(frame); off += n) {
+			n = write(pty_master, frame + off, sizeof(frame) - off);
+			if (n <= 0)
+				return (void *)1;
+		}
+		header->seq_num++;
+		sent += BENCH_PAYLOAD_SIZE;
+	}
+
+	return (void *)0;
+}
+
+static void *work()
+{
+	struct frame *frames[IO_BATCH_MAX];
+	struct iovec iov[IO_BATCH_MAX];
+	size_t n;
+
+	io_writer_open(ring.frames, ring.size * sizeof(struct frame));
+	while ((n = ring_front_batch(&ring, frames, IO_BATCH_MAX)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			iov[i].iov_base = frames[i]->payload;
+			iov[i].iov_len = frames[i]->header.payload_size;
+		}
+		io_writev(pipe_fd[1], iov, n);
+		ring_pop_batch(&ring, n);
+	}
+	io_writer_close();
+	worker_cpu = thread_cpu();
+
+	return (void *)0;
+}
+
+static void *drain()
+{
+	unsigned char buffer[65536];
+
+	while (read(pipe_fd[0], buffer, sizeof(buffer)) > 0)
+		;
+
+	return (void *)0;
+}
+
+// the framing of receive_byte() without the resync logic
+static bool bench_read(int fd)
+{
+	struct payload_header header;
+	unsigned char buffer[SERIAL_RX_BUFFER_SIZE];
+	unsigned char *p = (unsigned char *)&header;
+	const unsigned char *data;
+	size_t received = 0, bi = 0;
+	bool in_payload = false;
+	ssize_t n;
+
+	if (!io_reader_open(fd))
+		return false;
+
+	while (received < BENCH_DATA_SIZE) {
+		n = io_read(&data, 1000);
+		if (n <= 0) {
+			io_reader_close();
+			return false;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			if (!in_payload) {
+				p[bi++] = data[i];
+				if (bi == sizeof(header)) {
+					in_payload = true;
+					bi = 0;
+				}
+			} else {
+				buffer[bi++] = data[i];
+				if (bi == (size_t)header.payload_size) {
+					// unlike the device the generator can wait for the worker
+					while (atomic_load(&ring.head) - atomic_load(&ring.tail) >= ring.size)
+						sched_yield();
+					ring_push(&ring, &header, buffer);
+					received += bi;
+					in_payload = false;
+					bi = 0;
+				}
+			}
+		}
+		io_read_done();
+	}
+	reader_cpu = thread_cpu();
+	io_reader_close();
+
+	return true;
+}
+
+int main()
+{
+	pthread_t generator, worker, drainer;
+	struct timespec start, stop;
+	struct termios tio;
+	double seconds, mb;
+	int slave;
+	bool ok;
+
+	pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty_master == -1 || grantpt(pty_master) == -1 || unlockpt(pty_master) == -1) {
+		perror("Cannot create the pty");
+		return EXIT_FAILURE;
+	}
+	slave = open(ptsname(pty_master), O_RDWR | O_NOCTTY);
+	if (slave == -1 || pipe(pipe_fd) == -1) {
+		perror("Cannot open the pty or the pipe");
+		return EXIT_FAILURE;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	fcntl(pipe_fd[1], F_SETPIPE_SZ, 1024 * 1024);
+
+	if (!ring_init(&ring, "BENCH", BENCH_RING_SIZE))
+		return EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&drainer, NULL, drain, NULL);
+	pthread_create(&worker, NULL, work, NULL);
+	pthread_create(&generator, NULL, generate, NULL);
+	ok = bench_read(slave);
+	ring_close(&ring);
+	pthread_join(worker, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	close(pty_master);
+	close(slave);
+	pthread_join(generator, NULL);
+	close(pipe_fd[1]);
+	pthread_join(drainer, NULL);
+	close(pipe_fd[0]);
+
+	if (!ok) {
+		fprintf(stderr, "%s: the reader failed\n", io_backend_name);
+		return EXIT_FAILURE;
+	}
+
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	mb = BENCH_DATA_SIZE / (1024.0 * 1024.0);
+	printf("%-8s %.1f MB in %.2f s; reader %.1f ms/MB; worker %.1f ms/MB; %.0f syscalls/MB; dropped %lu\n",
+		io_backend_name, mb, seconds, reader_cpu * 1000 / mb, worker_cpu * 1000 / mb,
+		atomic_load(&io_stats.syscalls) / mb, atomic_load(&ring.dropped));
+	ring_free(&ring);
+
+	return EXIT_SUCCESS;
+}
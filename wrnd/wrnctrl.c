@@ -0,0 +1,398 @@
+// Copyright (c) 2016 Aleksandr Borisenko
+// Distributed under the terms of the GNU General Public License v2
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "devices.h"
+
+#define CLIENT_VERSION "0.2"
+#define DEFAULT_DEVICE "/dev/ttyS0"
+#define DEFAULT_BAUDRATE 57600
+#define WRND_CONFIG "/etc/conf.d/wrnd"
+#define DEFAULT_LOG_LINES 0
+#define AVRDUDE_CONF "/etc/avrdude.conf"
+#define AVRDUDE_BAUDRATE "115200"
+
+#define E_SYSERROR 1
+#define E_COMERROR 2
+#define E_OPTERROR 3
+
+static char *socket_path = COMMAND_SOCKET;
+static char *device_port = DEFAULT_DEVICE;
+static char config_device[PATH_MAX];
+static unsigned int device_baudrate = DEFAULT_BAUDRATE;
+static unsigned int response_timeout = COMMAND_RESPONSE_TIMEOUT;
+
+static void usage(char *progname)
+{
+	fprintf(stderr, "%s version %s, usage:\n", progname, CLIENT_VERSION);
+	fprintf(stderr, "%s [options] command\n", progname);
+	fprintf(stderr, "Options (default value in parenthesis):\n");
+	fprintf(stderr, "  -h, --help                  Print this help message\n");
+	fprintf(stderr, "  -s, --socket=file           Command socket of the daemon (%s)\n", COMMAND_SOCKET);
+	fprintf(stderr, "  -t, --timeout=ms            Time to wait for the response (%u)\n", COMMAND_RESPONSE_TIMEOUT);
+	fprintf(stderr, "  -D, --device-port=port      Serial port of the device to flash (%s)\n", device_port);
+	fprintf(stderr, "Commands:\n");
+	fprintf(stderr, "  stat                        Show status of the WRN device\n");
+	fprintf(stderr, "  wstat                       Show status of the WDT subsystem\n");
+	fprintf(stderr, "  rstat                       Show status of the RNG subsystem\n");
+	fprintf(stderr, "  extractor legacy|vn|peres   Set the bias removal of the RNG\n");
+	fprintf(stderr, "  bits n                      Take n low-order bits per RNG sample (0 - comparator, up to %d)\n",
+		RNG_SAMPLE_BITS_MAX);
+	fprintf(stderr, "  entropy                     Estimate the entropy of the low-order bits of the RNG samples\n");
+	fprintf(stderr, "  condition off|n             Condition n raw RNG bytes into one on the device (2..%d)\n",
+		RNG_CONDITIONER_MAX);
+	fprintf(stderr, "  resume                      Restart the RNG flood paused by the health tests\n");
+	fprintf(stderr, "  raw on|off                  Stream raw ADC samples to the capture file of the daemon\n");
+	fprintf(stderr, "  log [lines]                 Show number of lines of the log from the device (%u - all lines)\n",
+		DEFAULT_LOG_LINES);
+	fprintf(stderr, "  sched                       Show the time of the firmware tasks since the last call\n");
+	fprintf(stderr, "  budget nrf|rng|wdt|cmd n    Let the task repeat for up to n ticks of %d cycles per round (0 - once)\n",
+		SCHED_TIMER1_CYCLES);
+	fprintf(stderr, "  synctime                    Sync the device time with the host time\n");
+	fprintf(stderr, "  cleanlog                    Clear the EEPROM of the device\n");
+	fprintf(stderr, "  reset                       Reboot the device to set it to the initial state\n");
+	fprintf(stderr, "  flash file.hex              Prepare the device and program the .hex into the board\n");
+	fprintf(stderr, "                              NOTE: this function may be disabled at the hardware level\n");
+	fprintf(stderr, "                              (the port is prepared directly if the daemon is not running)\n");
+	exit(E_OPTERROR);
+}
+
+// the value of NAME=value, as the shell script sourced it; the quotes are optional
+static char *config_value(char *line, const char *name)
+{
+	char *value, *end;
+
+	value = line + strspn(line, " \t");
+	if (strncmp(value, name, strlen(name)) != 0)
+		return NULL;
+	value += strlen(name);
+	value[strcspn(value, "#\r\n")] = '\0';
+	if (*value == '"' || *value == '\'') {
+		end = strchr(value + 1, *value);
+		if (end == NULL)
+			return NULL;
+		*end = '\0';
+		value++;
+	} else
+		value[strcspn(value, " \t")] = '\0';
+
+	return strlen(value) > 0 ? value : NULL;
+}
+
+// WRND_DEVICE and WRND_BAUDRATE of the daemon config, the last assignment wins as in the shell
+static void read_config()
+{
+	FILE *f;
+	char line[PATH_MAX + 32], *value;
+
+	f = fopen(WRND_CONFIG, "r");
+	if (f == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((value = config_value(line, "WRND_DEVICE=")) != NULL) {
+			if (strlen(value) < sizeof(config_device)) {
+				strcpy(config_device, value);
+				device_port = config_device;
+			}
+		} else if ((value = config_value(line, "WRND_BAUDRATE=")) != NULL)
+			device_baudrate = (unsigned int)strtoul(value, NULL, 10);
+	}
+	fclose(f);
+}
+
+static void set_deadline(struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += response_timeout / 1000;
+	deadline->tv_nsec += (response_timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+static long time_left(struct timespec *deadline)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+// errno tells the caller why it failed; the daemon not running is reported only if it is required
+static int connect_daemon(bool required)
+{
+	int fd, err;
+	struct sockaddr_un addr;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot create the socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err = errno;
+		if (err != ENOENT && err != ECONNREFUSED)
+			fprintf(stderr, "Cannot connect to %s: %s\n", socket_path, strerror(err));
+		else if (required)
+			fprintf(stderr, "WRN daemon must be started to provide the communication with the device.\n");
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+// the daemon closes the connection when the response is complete
+static int device_cmd(const char *cmd, bool has_response)
+{
+	int fd, ret;
+	ssize_t n;
+	size_t received = 0;
+	long timeout;
+	char buffer[COMMAND_FEEDBACK_SIZE];
+	struct pollfd pfd;
+	struct timespec deadline;
+
+	fd = connect_daemon(true);
+	if (fd == -1)
+		return E_SYSERROR;
+
+	n = snprintf(buffer, sizeof(buffer), "%s\n", cmd);
+	if (write(fd, buffer, n) != n) {
+		fprintf(stderr, "Cannot send the command to the daemon: %s\n", strerror(errno));
+		close(fd);
+		return E_SYSERROR;
+	}
+
+	set_deadline(&deadline);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	ret = E_COMERROR;
+	while ((timeout = time_left(&deadline)) > 0) {
+		if (poll(&pfd, 1, timeout) <= 0)
+			break;
+		n = read(fd, buffer, sizeof(buffer));
+		if (n <= 0) {
+			if (n == 0)
+				ret = 0;
+			break;
+		}
+		fwrite(buffer, 1, n, stdout);
+		received += n;
+		set_deadline(&deadline);  // the log comes in pages, the timeout is of each one
+	}
+	close(fd);
+
+	if (ret == 0 && has_response && received == 0)
+		ret = E_COMERROR;
+	if (ret != 0)
+		fprintf(stderr, "No response from the device. Please try again.\n");
+
+	return ret;
+}
+
+// the port is free while the daemon is down, the commands are written to it as the script did
+static int port_cmd(const char *cmds)
+{
+	int fd;
+	ssize_t len = strlen(cmds);
+	struct termios ttyopts;
+
+	fd = open(device_port, O_RDWR | O_NOCTTY);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open %s: %s\n", device_port, strerror(errno));
+		return E_SYSERROR;
+	}
+
+	if (tcgetattr(fd, &ttyopts) == 0) {
+		cfmakeraw(&ttyopts);
+		ttyopts.c_cflag |= CREAD | CLOCAL;
+		ttyopts.c_cflag &= ~CRTSCTS;
+		cfsetspeed(&ttyopts, device_baudrate);
+		tcsetattr(fd, TCSANOW, &ttyopts);
+	}
+	if (write(fd, cmds, len) != len || tcdrain(fd) == -1) {
+		fprintf(stderr, "Cannot send the commands to %s: %s\n", device_port, strerror(errno));
+		close(fd);
+		return E_COMERROR;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static int device_flash(const char *hex)
+{
+	char port_arg[PATH_MAX + 3], flash_arg[PATH_MAX + 16];
+	int fd;
+
+	if (access(hex, R_OK) == -1) {
+		fprintf(stderr, "The file '%s' was not found.\n", hex);
+		return E_OPTERROR;
+	}
+
+	fd = connect_daemon(false);
+	if (fd == -1 && (errno == ENOENT || errno == ECONNREFUSED)) {
+		// WDT deactivate, RNG flood off, unlock DTR
+		if (port_cmd("W1\nR1\nC4\n") != 0)
+			return E_COMERROR;
+	} else {
+		if (fd == -1)
+			return E_SYSERROR;
+		close(fd);
+		if (device_cmd("W1", false) != 0)  // WDT deactivate
+			return E_COMERROR;
+		if (device_cmd("R1", false) != 0)  // RNG flood off
+			return E_COMERROR;
+		if (device_cmd("C4", false) != 0)  // unlock DTR
+			return E_COMERROR;
+	}
+
+	snprintf(port_arg, sizeof(port_arg), "-P%s", device_port);
+	snprintf(flash_arg, sizeof(flash_arg), "-Uflash:w:%s:i", hex);
+	execlp("avrdude", "avrdude", "-C" AVRDUDE_CONF, "-v", "-patmega328p", "-carduino", port_arg,
+		"-b" AVRDUDE_BAUDRATE, "-D", flash_arg, (char *)NULL);
+
+	fprintf(stderr, "Program 'avrdude' cannot be started: %s\n", strerror(errno));
+	return E_SYSERROR;
+}
+
+int main(int argc, char *const argv[])
+{
+	int opt = 0;
+	char *progname = basename(argv[0]);
+	char *opts = "hs:t:D:";
+	char cmd[COMMAND_MAX_SIZE];
+	const char *command, *arg;
+	struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"socket", required_argument, NULL, 's'},
+		{"timeout", required_argument, NULL, 't'},
+		{"device-port", required_argument, NULL, 'D'},
+		{NULL, 0, NULL, 0}
+	};
+
+	read_config();
+	while ((opt = getopt_long(argc, argv, opts, long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 's':
+			if (optarg != NULL && strlen(optarg) > 0)
+				socket_path = optarg;
+			break;
+		case 't':
+			if (optarg != NULL && strlen(optarg) > 0)
+				response_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			if (optarg != NULL && strlen(optarg) > 0)
+				device_port = optarg;
+			break;
+		case 'h':
+		default:
+			usage(progname);
+		}
+	}
+
+	// only the budget has two arguments
+	if (optind >= argc || argc - optind > 3 || (argc - optind == 3 && strcmp(argv[optind], "budget") != 0)) {
+		fprintf(stderr, "Wrong number of arguments specified.\n");
+		usage(progname);
+	}
+	command = argv[optind];
+	arg = (argc - optind >= 2) ? argv[optind + 1] : NULL;
+
+	if (strcmp(command, "stat") == 0)
+		return device_cmd("C2", true);
+	else if (strcmp(command, "wstat") == 0)
+		return device_cmd("W2", true);
+	else if (strcmp(command, "rstat") == 0)
+		return device_cmd("R2", true);
+	else if (strcmp(command, "extractor") == 0 && arg != NULL) {
+		const char *extractors[] = {"legacy", "vn", "peres"};
+		for (int i = RNG_EXTRACTOR_LEGACY; i < RNG_EXTRACTOR_UNKNOWN; i++) {
+			if (strcmp(arg, extractors[i]) == 0) {
+				snprintf(cmd, sizeof(cmd), "R3:%d", i);
+				return device_cmd(cmd, false);
+			}
+		}
+	} else if (strcmp(command, "bits") == 0 && arg != NULL) {
+		if (arg[strspn(arg, "0123456789")] == '\0' && strlen(arg) > 0 && atoi(arg) <= RNG_SAMPLE_BITS_MAX) {
+			snprintf(cmd, sizeof(cmd), "R4:%d", atoi(arg));
+			return device_cmd(cmd, false);
+		}
+	} else if (strcmp(command, "entropy") == 0)
+		return device_cmd("R5", true);
+	else if (strcmp(command, "resume") == 0)
+		return device_cmd("R0", false);
+	else if (strcmp(command, "condition") == 0 && arg != NULL) {
+		if (strcmp(arg, "off") == 0)
+			return device_cmd("R7:0", false);
+		if (arg[strspn(arg, "0123456789")] == '\0' && atoi(arg) >= 2 && atoi(arg) <= RNG_CONDITIONER_MAX) {
+			snprintf(cmd, sizeof(cmd), "R7:%d", atoi(arg));
+			return device_cmd(cmd, false);
+		}
+	} else if (strcmp(command, "raw") == 0 && arg != NULL) {
+		if (strcmp(arg, "on") == 0)
+			return device_cmd("R6:1", false);
+		else if (strcmp(arg, "off") == 0)
+			return device_cmd("R6:0", false);
+	} else if (strcmp(command, "log") == 0) {
+		unsigned long lines = DEFAULT_LOG_LINES;
+		if (arg != NULL && arg[strspn(arg, "0123456789")] == '\0' && strlen(arg) > 0)
+			lines = strtoul(arg, NULL, 10);
+		snprintf(cmd, sizeof(cmd), "W4:%lu", lines);
+		return device_cmd(cmd, true);
+	} else if (strcmp(command, "sched") == 0)
+		return device_cmd("C6", true);
+	else if (strcmp(command, "budget") == 0 && arg != NULL && argc - optind == 3) {
+		const char *tasks[] = {"nrf", "rng", "wdt", "cmd"};
+		const char *ticks = argv[optind + 2];
+		for (int i = 0; i < SCHED_TASKS; i++) {
+			if (strcmp(arg, tasks[i]) == 0 && ticks[strspn(ticks, "0123456789")] == '\0' && strlen(ticks) > 0
+					&& strtoul(ticks, NULL, 10) <= UINT16_MAX) {
+				snprintf(cmd, sizeof(cmd), "C7:%d:%lu", i, strtoul(ticks, NULL, 10));
+				return device_cmd(cmd, false);
+			}
+		}
+	} else if (strcmp(command, "synctime") == 0) {
+		snprintf(cmd, sizeof(cmd), "C1:%lld", (long long)time(NULL));
+		return device_cmd(cmd, false);
+	} else if (strcmp(command, "cleanlog") == 0) {
+		if (response_timeout < COMMAND_LOG_CLEAN_TIMEOUT)
+			response_timeout = COMMAND_LOG_CLEAN_TIMEOUT;
+		return device_cmd("C5", true);
+	} else if (strcmp(command, "reset") == 0) {
+		if (device_cmd("C3", false) != 0)
+			return E_COMERROR;
+		printf("A reboot request has been sent to the device.\n");
+		return 0;
+	} else if (strcmp(command, "flash") == 0 && arg != NULL)
+		return device_flash(arg);
+
+	fprintf(stderr, "Unknown argument: %s.\n", command);
+	usage(progname);
+	return E_OPTERROR;
+}
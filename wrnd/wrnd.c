@@ -19,8 +19,12 @@
 #include "utils.h"
 #include "log.h"
 #include "devices.h"
+#include "pipeline.h"
+#include "iobackend.h"
 
 static bool server_running = true;
+static volatile sig_atomic_t logrotate_requested = false;
+static volatile sig_atomic_t stats_requested = false;
 static int exit_code = EXIT_FAILURE;
 int serial_fd = -1;
 
@@ -30,6 +34,11 @@ struct arguments default_arguments = {
 	.vtime = 5,
 	.rng_fifo = "/run/wrnd/rng.fifo",
 	.nrf_fifo = "/run/wrnd/nrf.fifo",
+	.rng_policy = SINK_DROP_OLDEST,
+	.nrf_policy = SINK_DROP_NEWEST,
+	.cmd_policy = SINK_DROP_NEWEST,
+	.raw_file = NULL,
+	.rng_latency = 0,
 	.pid_file = "/run/wrnd/pid",
 	.wdt_fifo = "/run/wrnd/wdt.fifo",
 	.wdt_timeout = 180,
@@ -50,6 +59,14 @@ static void usage(char *progname)
 	fprintf(stderr, "  -t, --timeout=vtime         Tenths of a second for serial port read cycle (%u)\n", default_arguments.vtime);
 	fprintf(stderr, "  -r, --rng-fifo=file         FIFO for RNG (%s)\n", default_arguments.rng_fifo);
 	fprintf(stderr, "  -n, --nrf-fifo=file         FIFO for nRF24l01+ (%s)\n", default_arguments.nrf_fifo);
+	fprintf(stderr, "  -o, --rng-overflow=policy   Policy for RNG when the FIFO reader is behind (%s)\n",
+		sink_policy_name(default_arguments.rng_policy));
+	fprintf(stderr, "  -O, --nrf-overflow=policy   Policy for nRF24l01+ (%s)\n", sink_policy_name(default_arguments.nrf_policy));
+	fprintf(stderr, "  -c, --cmd-overflow=policy   Policy for the command FIFO (%s)\n", sink_policy_name(default_arguments.cmd_policy));
+	fprintf(stderr, "                              drop-oldest|drop-newest|block\n");
+	fprintf(stderr, "  -l, --rng-latency=ms        Latency goal for RNG payloads, 0 - the best throughput (%u)\n",
+		default_arguments.rng_latency);
+	fprintf(stderr, "  -a, --raw-capture=file      Stream raw ADC samples of the RNG to the file (off)\n");
 	fprintf(stderr, "  -p, --pid-file=file         Name for the PID file (%s)\n", default_arguments.pid_file);
 	fprintf(stderr, "  -w, --wdt-fifo=file         FIFO for the watchdog daemon (%s)\n", default_arguments.wdt_fifo);
 	fprintf(stderr, "  -T, --wdt-timeout=timeout   The watchdog trigger timeout [min: %u, max: %u] (%u)\n",
@@ -68,134 +85,311 @@ static void term_signal(int signo)
 
 static void logrotate_signal(int signo)
 {
-	reopen_logs();
+	// the logs are locked by the writer, so they are reopened by the main loop
+	logrotate_requested = true;
+}
+
+static void stats_signal(int signo)
+{
+	stats_requested = true;
+}
+
+// the recent bytes are searched for a header, so a few lost bytes do not cost a resync
+static void start_recovery(struct rx_state *rx)
+{
+	unsigned int n = rx->hi < SERIAL_RX_HISTORY_SIZE ? rx->hi : SERIAL_RX_HISTORY_SIZE;
+
+	for (unsigned int i = 0; i < n; i++)
+		rx->window[i] = rx->history[(rx->hi - n + i) % SERIAL_RX_HISTORY_SIZE];
+	rx->wlen = n;
+	rx->wpos = 0;
+	rx->bi = 0;
+	rx->status = TX_RECOVER;
+	gettimeofday(&rx->recovery_started, NULL);
+}
+
+// The parser continues from the header found, the rest of the window is received again
+// by receive_byte(). A relock during the replay puts its window before the bytes left.
+static void relock(struct rx_state *rx, int pos, uint16_t lost)
+{
+	int n = rx->wlen - pos, rest = rx->rlen - rx->rpos;
+
+	rx->wlen = 0;
+	rx->wpos = 0;
+	if (n + rest > SERIAL_RX_WINDOW_SIZE) {
+		log_message(WRND_ERROR, "The stream cannot be replayed after %d bytes, the daemon is to be synced", n + rest);
+		rx->status = TX_UNKNOWN;
+		return;
+	}
+	memmove(rx->replay + n, rx->replay + rx->rpos, rest);
+	memcpy(rx->replay, rx->window + pos, n);
+	rx->rlen = n + rest;
+	rx->rpos = 0;
+
+	rx->recoveries++;
+	rx->lost_frames += lost;
+	if ((enum verbose_level)arguments->verbose > VERBOSE_L0)
+		log_message(WRND_COMMON, "The stream has been recovered, %u frame(s) lost", lost);
+
+	rx->seq_num += lost;
+	rx->bi = 0;
+	rx->status = TX_HEADER;
+}
+
+// a candidate is plausible by itself and confirmed by the next header
+static bool recover_byte(struct rx_state *rx, unsigned char c)
+{
+	struct payload_header candidate, next;
+	int p, next_pos;
+	uint16_t lost;
+
+	rx->window[rx->wlen++] = c;
+	for (p = rx->wpos; p + (int)sizeof(candidate) <= rx->wlen; p++) {
+		memcpy(&candidate, rx->window + p, sizeof(candidate));
+		lost = candidate.seq_num - rx->seq_num;
+		if (lost > SERIAL_RECOVERY_SEQ_WINDOW || !device_header_plausible(&candidate))
+			continue;
+
+		next_pos = p + sizeof(candidate) + (candidate.payload_size > 0 ? candidate.payload_size : 0);
+		if (next_pos + (int)sizeof(next) > rx->wlen)
+			break;  // wait for the next header
+		memcpy(&next, rx->window + next_pos, sizeof(next));
+		if (next.seq_num == (uint16_t)(candidate.seq_num + 1) && device_header_plausible(&next)) {
+			relock(rx, p, lost);
+			return true;
+		}
+	}
+	rx->wpos = p;
+
+	if (rx->wlen >= SERIAL_RX_WINDOW_SIZE) {
+		log_message(WRND_ERROR, "No header has been found in %d bytes, the daemon is to be synced", rx->wlen);
+		rx->status = TX_UNKNOWN;
+	}
+
+	return true;
+}
+
+static bool parse_byte(struct rx_state *rx, unsigned char c)
+{
+	if (rx->status == TX_RECOVER)
+		return recover_byte(rx, c);
+
+	rx->history[rx->hi++ % SERIAL_RX_HISTORY_SIZE] = c;
+	*(rx->buffer + rx->bi) = c;
+	rx->bi++;
+	if (rx->status == TX_HEADER && rx->bi >= sizeof(rx->header)) {
+		rx->bi = 0;
+		memcpy(&rx->header, &rx->buffer, sizeof(rx->header));
+
+		if (rx->header.seq_num != rx->seq_num || !device_header_plausible(&rx->header)) {
+			log_message(WRND_ERROR, "The daemon is out of sync with the device %d:[%d]", rx->header.seq_num, rx->seq_num);
+			start_recovery(rx);
+			return true;
+		} else
+			rx->seq_num++;
+
+		if (rx->header.payload_size > 0)
+			rx->status = TX_PAYLOAD;
+		else if (rx->header.payload_size == 0 && (enum command_type)rx->header.type_id == CMD_COMMON
+				&& (enum common_command)rx->header.cmd_id == COMMON_RESET) {
+			log_message(WRND_COMMON, "The daemon has been received the device RESET command without loss of sync");
+			// it is a very rare behaviour, so it is not a problem to resync the daemon for the device initialization
+			rx->status = TX_UNKNOWN;
+			rx->seq_num = 0;
+			return true;
+		} else
+			pipeline_push(&rx->header, NULL);  // confirmation or error
+
+	} else if (rx->status == TX_PAYLOAD && rx->bi >= rx->header.payload_size) {
+		pipeline_push(&rx->header, rx->buffer);
+		rx->bi = 0;
+		rx->status = TX_HEADER;
+	}
+
+	if (rx->bi >= SERIAL_RX_BUFFER_SIZE) {
+		log_message(WRND_ERROR, "Serial RX buffer overflow detected %d:[%d]", rx->bi, SERIAL_RX_BUFFER_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
+// returns false if the daemon cannot continue; the bytes of a relock are received here,
+// not by the recovery itself, so a loss among them does not nest
+static bool receive_byte(struct rx_state *rx, unsigned char c)
+{
+	bool ok = parse_byte(rx, c);
+
+	while (ok && rx->rpos < rx->rlen && rx->status != TX_UNKNOWN)
+		ok = parse_byte(rx, rx->replay[rx->rpos++]);
+	rx->rlen = 0;
+	rx->rpos = 0;
+
+	return ok;
+}
+
+// returns the number of bytes up to the end of the 0xFF run or -1 if the run is not complete yet,
+// the run may be split between reads and anything received before it is skipped
+static int scan_sync(struct rx_state *rx, const unsigned char *data, int n)
+{
+	const unsigned char *p = data, *end = data + n;
+
+	while (p < end) {
+		if (*p != 0xFF) {
+			rx->sync_run = 0;
+			p = memchr(p, 0xFF, end - p);
+			if (p == NULL)
+				return -1;
+		}
+		rx->sync_run++;
+		p++;
+		if (rx->sync_run >= SERIAL_RX_SYNC_SEQUENCE) {
+			while (p < end && *p == 0xFF)  // a header never starts with 0xFF
+				p++;
+			return p - data;
+		}
+	}
+
+	return -1;
+}
+
+// the port stays open unless the fast attempts have failed
+static bool start_sync(bool reopen)
+{
+	if (reopen) {
+		io_reader_close();
+		if (serial_fd != -1)
+			close(serial_fd);
+		serial_fd = serialport_init(arguments->device_port, arguments->baud_rate, arguments->vtime);
+		if (serial_fd < 0)
+			return false;
+	}
+
+	if ((enum verbose_level)arguments->verbose > VERBOSE_L0)
+		log_message(WRND_COMMON, "Sync with the device is about to be started%s", reopen ? " (the port is reopened)" : "");
+
+	if (!device_write_command("R1", "RNG:FLOOD-OFF"))
+		return false;
+
+	// the bytes which are still on the wire are skipped by scan_sync
+	serialport_flush(serial_fd);
+	if (!device_send_sync(SERIAL_RX_SYNC_SEQUENCE))
+		return false;
+
+	if (reopen && !io_reader_open(serial_fd))
+		return false;
+
+	return true;
 }
 
 static void do_loop()
 {
-	int n = 0, bi = 0;
-	unsigned char c;
-	unsigned char buffer[SERIAL_RX_BUFFER_SIZE];
-	struct payload_header header;
-	enum transmission_status status = TX_UNKNOWN;
-	uint16_t seq_num = 0;
-	bool sequence_found = false;
-	int sync_retried = 0;
+	int n = 0, skip;
+	const unsigned char *data;
+	struct rx_state rx = {.status = TX_UNKNOWN, .bi = 0, .seq_num = 0, .sync_run = 0};
+	int sync_retried = 0, sync_reopened = 0;
+	unsigned long sync_timeout = SERIAL_SYNC_TIMEOUT_MIN, sync_latency = 0, elapsed;
 	struct timeval sync_started = {.tv_sec = 0, .tv_usec = 0};
 
-	if (sizeof(header) > SERIAL_RX_BUFFER_SIZE) {
+	if (sizeof(rx.header) > SERIAL_RX_BUFFER_SIZE) {
 		log_message(WRND_ERROR, "Serial RX buffer is too small");
 		server_running = false;
 	}
 
-	while (server_running) {
-		if (status == TX_UNKNOWN) {
-			if (serial_fd != -1)
-				close(serial_fd);
-			serial_fd = serialport_init(arguments->device_port, arguments->baud_rate, arguments->vtime);
-			if (serial_fd < 0)
-				break;
+	if (!pipeline_start())
+		server_running = false;
 
-			if ((enum verbose_level)arguments->verbose > VERBOSE_L0)
-				log_message(WRND_COMMON, "Sync with the device is about to be started");
+	if (server_running && !io_reader_open(serial_fd))
+		server_running = false;
 
-			if (!device_write_command("R1", "RNG:FLOOD-OFF"))
-				break;
+	while (server_running) {
+		if (logrotate_requested) {
+			logrotate_requested = false;
+			reopen_logs();
+		}
+		if (stats_requested) {
+			stats_requested = false;
+			log_message(WRND_COMMON, "Serial RX: recoveries %lu; lost frames %lu; resyncs %lu",
+				rx.recoveries, rx.lost_frames, rx.resyncs);
+			log_pipeline_stats();
+		}
 
-			while (read(serial_fd, &c, 1) > 0);  // clean input buffer
-			if (!device_send_sync(SERIAL_RX_SYNC_SEQUENCE))
+		if (rx.status == TX_RECOVER && time_delta(&rx.recovery_started) >= SERIAL_RECOVERY_TIMEOUT) {
+			log_message(WRND_ERROR, "No header has been found in %d ms, the daemon is to be synced", SERIAL_RECOVERY_TIMEOUT);
+			rx.status = TX_UNKNOWN;
+		}
+
+		if (rx.status == TX_UNKNOWN) {
+			if (sync_retried == 0 && sync_latency > 0)
+				rx.resyncs++;
+			if (sync_retried == 0)  // a few round trips of the last successful sync
+				sync_timeout = sync_latency * 4 > SERIAL_SYNC_TIMEOUT_MIN ? sync_latency * 4 : SERIAL_SYNC_TIMEOUT_MIN;
+			if (!start_sync(sync_retried >= SERIAL_SYNC_RETRY))
 				break;
 
 			gettimeofday(&sync_started, NULL);
-			bi = 0;
-			status = TX_SYNC;
-		} else if (status == TX_SYNC && time_delta(&sync_started) > SERIAL_SYNC_TIMEOUT) {
-			sync_retried++;
-			if (sync_retried >= SERIAL_SYNC_RETRY) {
+			rx.bi = 0;
+			rx.sync_run = 0;
+			rx.status = TX_SYNC;
+		} else if (rx.status == TX_SYNC && (elapsed = time_delta(&sync_started)) >= sync_timeout) {
+			if (sync_retried >= SERIAL_SYNC_RETRY && ++sync_reopened >= SERIAL_SYNC_REOPEN) {
 				log_message(WRND_ERROR, "Sync with the device failed");
 				break;
 			}
-			bi = 0;
-			status = TX_UNKNOWN;
+			log_message(WRND_ERROR, "Sync with the device timed out after %lu ms", elapsed);
+			sync_retried++;
+			sync_timeout = sync_retried >= SERIAL_SYNC_RETRY ? SERIAL_SYNC_TIMEOUT : sync_timeout * 2;
+			if (sync_timeout > SERIAL_SYNC_TIMEOUT)
+				sync_timeout = SERIAL_SYNC_TIMEOUT;
+			rx.status = TX_UNKNOWN;
 			continue;
 		}
 
-		n = read(serial_fd, &c, 1);
+		// the read returns as soon as some bytes are available or after vtime
+		if (rx.status == TX_SYNC) {
+			elapsed = time_delta(&sync_started);
+			n = io_read(&data, elapsed < sync_timeout ? sync_timeout - elapsed : 0);
+		} else if (rx.status == TX_RECOVER) {
+			elapsed = time_delta(&rx.recovery_started);
+			n = io_read(&data, elapsed < SERIAL_RECOVERY_TIMEOUT ? SERIAL_RECOVERY_TIMEOUT - elapsed : 0);
+		} else
+			n = io_read(&data, arguments->vtime * 100);
 		if (n == -1) {
 			log_message(WRND_ERROR, "Could not read the serial port: %s", strerror(errno));
 			break;
-		} else if (n == 0)
-			continue;
+		}
 
-		*(buffer + bi) = c;
-		bi++;
-		if (status == TX_HEADER && bi >= sizeof(header)) {
-			bi = 0;
-			memcpy(&header, &buffer, sizeof(header));
-
-			if ((enum verbose_level)arguments->verbose > VERBOSE_L1)
-				log_device_header(&header);
-
-			if (header.seq_num != seq_num) {
-				log_message(WRND_ERROR, "The daemon is out of sync with the device %d:[%d]", header.seq_num, seq_num);
-				status = TX_UNKNOWN;
-				seq_num = 0;
-				continue;
-			} else
-				seq_num++;
-
-			if (header.payload_size < 0)
-				log_device_error(&header);
-			else if (header.payload_size > 0)
-				status = TX_PAYLOAD;
-			else if ((enum command_type)header.type_id == CMD_COMMON && (enum common_command)header.cmd_id == COMMON_RESET) {
-				log_message(WRND_COMMON, "The daemon has been received the device RESET command without loss of sync");
-				// it is a very rare behaviour, so it is not a problem to resync the daemon for the device initialization
-				status = TX_UNKNOWN;
-				seq_num = 0;
-				continue;
-			} else
-				process_confirmation(&header);
-
-		} else if (status == TX_SYNC && c == 0xFF && bi >= SERIAL_RX_SYNC_SEQUENCE) {
-			sequence_found = true;
-			for (int i = 2; i <= SERIAL_RX_SYNC_SEQUENCE; i++) {
-				if (buffer[bi - i] != 0xFF) {
-					sequence_found = false; 
+		skip = 0;
+		if (rx.status == TX_SYNC && n > 0) {
+			skip = scan_sync(&rx, data, n);
+			if (skip == -1)
+				skip = n;
+			else {
+				sync_latency = time_delta(&sync_started);
+				log_message(WRND_COMMON, "The daemon has been successfully synced in %lu ms", sync_latency);
+				rx.bi = 0;
+				rx.seq_num = 0;
+				rx.status = TX_HEADER;
+				sync_retried = 0;
+				sync_reopened = 0;
+				if (!init_device()) {
+					io_read_done();
 					break;
 				}
 			}
-			if (sequence_found) {
-				log_message(WRND_COMMON, "The daemon has been successfully synced");
-				if (!init_device())
-					break;
-				sync_retried = 0;
-				bi = 0;
-				status = TX_HEADER;
-				continue;
-			}
-
-		} else if (status == TX_PAYLOAD && bi >= header.payload_size) {
-			if ((enum verbose_level)arguments->verbose > VERBOSE_L2)
-				log_device_payload(&header, buffer);
-
-			process_payload(&header, buffer);
-			bi = 0;
-			status = TX_HEADER;
 		}
 
-		if (bi >= SERIAL_RX_BUFFER_SIZE) {
-			log_message(WRND_ERROR, "Serial RX buffer overflow detected %d:[%d]", bi, SERIAL_RX_BUFFER_SIZE);
-			if (status == TX_SYNC) {
-				bi = 0;
-				status = TX_UNKNOWN;
-				continue;
-			}
-			else
+		for (int i = skip; i < n && rx.status != TX_UNKNOWN; i++) {
+			if (!receive_byte(&rx, data[i])) {
+				server_running = false;
 				break;
+			}
 		}
+		io_read_done();
 	} // while server_running
 
+	io_reader_close();
+	pipeline_stop();
 	close_device();
 }
 
@@ -203,7 +397,7 @@ int main(int argc, char *const argv[])
 {
 	int opt = 0;
 	char *progname = basename(argv[0]);
-	char *opts = "hD:b:t:r:n:p:w:T:Nv:d";
+	char *opts = "hD:b:t:r:n:o:O:c:l:a:p:w:T:Nv:d";
 	struct option long_options[] = {
 		{"help", no_argument, NULL, 'h'},
 		{"device-port", required_argument, NULL, 'D'},
@@ -211,6 +405,11 @@ int main(int argc, char *const argv[])
 		{"timeout", required_argument, NULL, 't'},
 		{"rng-fifo", required_argument, NULL, 'r'},
 		{"nrf-fifo", required_argument, NULL, 'n'},
+		{"rng-overflow", required_argument, NULL, 'o'},
+		{"nrf-overflow", required_argument, NULL, 'O'},
+		{"cmd-overflow", required_argument, NULL, 'c'},
+		{"rng-latency", required_argument, NULL, 'l'},
+		{"raw-capture", required_argument, NULL, 'a'},
 		{"pid-file", required_argument, NULL, 'p'},
 		{"wdt-fifo", required_argument, NULL, 'w'},
 		{"wdt-timeout", required_argument, NULL, 'T'},
@@ -245,6 +444,26 @@ int main(int argc, char *const argv[])
 			if (optarg != NULL && strlen(optarg) > 0)
 				arguments->nrf_fifo = optarg;
 			break;
+		case 'o':
+		case 'O':
+		case 'c':
+			if (optarg == NULL || sink_policy_parse(optarg) == SINK_UNKNOWN)
+				usage(progname);
+			if (opt == 'o')
+				arguments->rng_policy = sink_policy_parse(optarg);
+			else if (opt == 'O')
+				arguments->nrf_policy = sink_policy_parse(optarg);
+			else
+				arguments->cmd_policy = sink_policy_parse(optarg);
+			break;
+		case 'l':
+			if (optarg != NULL && strlen(optarg) > 0)
+				arguments->rng_latency = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			if (optarg != NULL && strlen(optarg) > 0)
+				arguments->raw_file = optarg;
+			break;
 		case 'p':
 			if (optarg != NULL && strlen(optarg) > 0)
 				arguments->pid_file = optarg;
@@ -295,7 +514,7 @@ int main(int argc, char *const argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (!init_fifos())
+	if (!init_fifos() || !open_raw_capture())
 		return EXIT_FAILURE;
 
 	// check if the serial port available
@@ -316,6 +535,7 @@ int main(int argc, char *const argv[])
 
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGHUP, logrotate_signal);
+	signal(SIGUSR1, stats_signal);
 	signal(SIGINT, term_signal);
 	signal(SIGTERM, term_signal);
 
@@ -324,12 +544,19 @@ int main(int argc, char *const argv[])
 		return EXIT_FAILURE;
 	}
 
-	log_message(WRND_COMMON, "+++ Daemon %s has been started", progname);
+	if (!wrn_cmd_open()) {
+		wrn_wdt_close();
+		close(serial_fd);
+		return EXIT_FAILURE;
+	}
+
+	log_message(WRND_COMMON, "+++ Daemon %s has been started (I/O backend: %s)", progname, io_backend_name);
 	do_loop();
 
     unlink(arguments->pid_file);
     log_message(WRND_COMMON, "Daemon %s has been stopped", progname);
 
+	wrn_cmd_close();
 	wrn_wdt_close();
 
 	if (serial_fd != -1)
@@ -8,16 +8,26 @@
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/time.h>
 #include "log.h"
+#include "devices.h"
+#include "sink.h"
 
 #define MAJOR_VERSION 0
 #define MINOR_VERSION 2
 
 #define DEFAULT_PIDDIR "/run/wrnd"
 #define SERIAL_RX_BUFFER_SIZE 1024  // may came from WDT:LOG
-#define SERIAL_RX_SYNC_SEQUENCE 3
+#define SERIAL_RX_CHUNK_SIZE 256  // bytes per read
+#define SERIAL_RX_HISTORY_SIZE 32  // bytes to look back for a header after a loss, power of 2
+#define SERIAL_RX_WINDOW_SIZE (2 * SERIAL_RX_BUFFER_SIZE)  // bytes to look for a header in
+#define SERIAL_RECOVERY_SEQ_WINDOW 64  // frames which may be lost without a resync
+#define SERIAL_RECOVERY_TIMEOUT 250  // ms
+#define SERIAL_RX_SYNC_SEQUENCE 8  // MAX_SYNC_SEQUENCE, a longer run is less likely inside RNG data
+#define SERIAL_SYNC_TIMEOUT_MIN 50  // ms, doubled for every retry
 #define SERIAL_SYNC_TIMEOUT 2000  // ms
-#define SERIAL_SYNC_RETRY 3
+#define SERIAL_SYNC_RETRY 5  // attempts with the port kept open
+#define SERIAL_SYNC_REOPEN 3  // attempts with the port reopened
 #define MAX_VERBOSE_LEVEL 3
 
 #define LOG_EMERG   0   // system is unusable
@@ -33,9 +43,33 @@ enum transmission_status {
 	TX_HEADER,
 	TX_PAYLOAD,
 	TX_SYNC,
+	TX_RECOVER,
 	TX_UNKNOWN
 };
 
+struct rx_state {
+	enum transmission_status status;
+	unsigned char buffer[SERIAL_RX_BUFFER_SIZE];
+	int bi;
+	struct payload_header header;
+	uint16_t seq_num;
+	int sync_run;  // 0xFF bytes received in a row
+	// recovery after a loss
+	unsigned char history[SERIAL_RX_HISTORY_SIZE];
+	unsigned int hi;  // bytes ever put into the history
+	unsigned char window[SERIAL_RX_WINDOW_SIZE];
+	int wlen;
+	int wpos;  // the first position not rejected yet
+	struct timeval recovery_started;
+	unsigned char replay[SERIAL_RX_WINDOW_SIZE];  // the rest of the window after a relock
+	int rlen;
+	int rpos;  // the next byte to be received again
+	// metrics
+	unsigned long recoveries;
+	unsigned long lost_frames;
+	unsigned long resyncs;
+};
+
 enum verbose_level {
 	VERBOSE_L0 = 0,
 	VERBOSE_L1,
@@ -49,6 +83,11 @@ struct arguments {
 	unsigned char vtime;
 	char *rng_fifo;
 	char *nrf_fifo;
+	enum sink_policy rng_policy;
+	enum sink_policy nrf_policy;
+	enum sink_policy cmd_policy;
+	char *raw_file;
+	unsigned int rng_latency;  // ms
 	char *pid_file;
 	char *wdt_fifo;
 	unsigned int wdt_timeout;